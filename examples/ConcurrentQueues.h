@@ -0,0 +1,231 @@
+#pragma once
+
+#include "Common.h"
+#include <atomic>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace sb { namespace common {
+
+static const size_t cache_line_size = 64;
+
+inline size_t round_up_pow2(size_t value)
+{
+    size_t res = 1;
+    while (res < value) res <<= 1;
+    return res;
+}
+
+/// Chase-Lev work-stealing deque with fixed capacity.
+/// The owner thread pushes and pops at the bottom, any thread may steal from the top.
+template<typename T>
+class WorkStealingDeque : public noncopyable
+{
+public:
+    explicit WorkStealingDeque(size_t capacity)
+        : m_top(0), m_bottom(0), m_buffer(round_up_pow2(capacity)), m_mask(m_buffer.size() - 1) {}
+
+    /// owner only, false if deque is full
+    bool push(T *item)
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_acquire);
+        if (b - t > static_cast<int64_t>(m_mask)) return false;
+        m_buffer[b & m_mask].store(item, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /// owner only, LIFO end
+    T *pop()
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+        if (t > b) {
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        T *item = m_buffer[b & m_mask].load(std::memory_order_relaxed);
+        if (t == b) {
+            /// last item, race with thieves
+            if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                item = nullptr;
+            }
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    /// any thread, FIFO end; nullptr if empty or the race was lost
+    T *steal()
+    {
+        int64_t t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = m_bottom.load(std::memory_order_acquire);
+        if (t >= b) return nullptr;
+        T *item = m_buffer[t & m_mask].load(std::memory_order_relaxed);
+        if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return item;
+    }
+
+    /// approximate when called concurrently
+    size_t size() const
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+        return b > t ? static_cast<size_t>(b - t) : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+
+private:
+    std::atomic<int64_t>          m_top;
+    char                          m_pad0[cache_line_size - sizeof(std::atomic<int64_t>)];
+    std::atomic<int64_t>          m_bottom;
+    char                          m_pad1[cache_line_size - sizeof(std::atomic<int64_t>)];
+    std::vector<std::atomic<T*> > m_buffer;
+    size_t                        m_mask;
+};
+
+/// Bounded multi-producer multi-consumer queue (D. Vyukov).
+template<typename T>
+class BoundedQueue : public noncopyable
+{
+public:
+    explicit BoundedQueue(size_t capacity)
+        : m_buffer(round_up_pow2(capacity)), m_mask(m_buffer.size() - 1), m_enqueue_pos(0), m_dequeue_pos(0)
+    {
+        for (size_t i = 0; i < m_buffer.size(); ++i) {
+            m_buffer[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    /// false if queue is full
+    bool push(T *item)
+    {
+        cell *c;
+        size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            c = &m_buffer[pos & m_mask];
+            size_t seq = c->sequence.load(std::memory_order_acquire);
+            intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (dif == 0) {
+                if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        c->data = item;
+        c->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// nullptr if queue is empty
+    T *pop()
+    {
+        cell *c;
+        size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            c = &m_buffer[pos & m_mask];
+            size_t seq = c->sequence.load(std::memory_order_acquire);
+            intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (dif == 0) {
+                if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (dif < 0) {
+                return nullptr;
+            } else {
+                pos = m_dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        T *item = c->data;
+        c->sequence.store(pos + m_mask + 1, std::memory_order_release);
+        return item;
+    }
+
+    /// approximate when called concurrently
+    size_t size() const
+    {
+        size_t e = m_enqueue_pos.load(std::memory_order_relaxed);
+        size_t d = m_dequeue_pos.load(std::memory_order_relaxed);
+        return e > d ? e - d : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+    size_t capacity() const { return m_mask + 1; }
+
+private:
+    struct cell
+    {
+        std::atomic<size_t> sequence;
+        T                  *data;
+    };
+
+    std::vector<cell>   m_buffer;
+    size_t              m_mask;
+    char                m_pad0[cache_line_size];
+    std::atomic<size_t> m_enqueue_pos;
+    char                m_pad1[cache_line_size - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> m_dequeue_pos;
+    char                m_pad2[cache_line_size - sizeof(std::atomic<size_t>)];
+};
+
+/// Unbounded intrusive multi-producer single-consumer queue (D. Vyukov).
+/// T must be default constructible and provide `std::atomic<T*> next`.
+template<typename T>
+class IntrusiveMpscQueue : public noncopyable
+{
+public:
+    IntrusiveMpscQueue() : m_head(&m_stub), m_tail(&m_stub)
+    {
+        m_stub.next.store(nullptr, std::memory_order_relaxed);
+    }
+
+    /// any thread
+    void push(T *item)
+    {
+        item->next.store(nullptr, std::memory_order_relaxed);
+        T *prev = m_head.exchange(item, std::memory_order_acq_rel);
+        prev->next.store(item, std::memory_order_release);
+    }
+
+    /// consumer only; may return nullptr while a producer is between its two steps
+    T *pop()
+    {
+        T *tail = m_tail;
+        T *next = tail->next.load(std::memory_order_acquire);
+        if (tail == &m_stub) {
+            if (!next) return nullptr;
+            m_tail = next;
+            tail   = next;
+            next   = next->next.load(std::memory_order_acquire);
+        }
+        if (next) {
+            m_tail = next;
+            return tail;
+        }
+        if (tail != m_head.load(std::memory_order_acquire)) return nullptr;
+        push(&m_stub);
+        next = tail->next.load(std::memory_order_acquire);
+        if (next) {
+            m_tail = next;
+            return tail;
+        }
+        return nullptr;
+    }
+
+private:
+    std::atomic<T*> m_head;
+    char            m_pad0[cache_line_size - sizeof(std::atomic<T*>)];
+    T              *m_tail;
+    T               m_stub;
+};
+
+}} // namespace
@@ -0,0 +1,383 @@
+#pragma once
+
+#include "common/ThreadPool.h"
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include <coroutine>
+#include <optional>
+#include <utility>
+
+namespace sb { namespace common {
+
+namespace detail {
+
+/// Per-thread free lists of coroutine frames by 64-byte size class, so suspending and
+/// resuming pipelines do not hit malloc once warm. Frames freed on another thread
+/// simply join that thread's cache.
+class coroutine_frame_pool
+{
+public:
+    static const size_t GRANULARITY  = 64;
+    static const size_t SIZE_CLASSES = 32;
+    /// blocks kept per size class and thread, the rest goes back to the heap
+    static const size_t MAX_CACHED   = 64;
+
+    static void *allocate(size_t size)
+    {
+        const size_t index = (size + GRANULARITY - 1) / GRANULARITY;
+        if (index >= SIZE_CLASSES) return ::operator new(size);
+        cache &c = local();
+        if (block *b = c.heads[index]) {
+            c.heads[index] = b->next;
+            --c.counts[index];
+            return b;
+        }
+        return ::operator new(index * GRANULARITY);
+    }
+
+    static void deallocate(void *ptr, size_t size)
+    {
+        const size_t index = (size + GRANULARITY - 1) / GRANULARITY;
+        if (index >= SIZE_CLASSES) {
+            ::operator delete(ptr);
+            return;
+        }
+        cache &c = local();
+        if (c.counts[index] >= MAX_CACHED) {
+            ::operator delete(ptr);
+            return;
+        }
+        block *b = static_cast<block *>(ptr);
+        b->next = c.heads[index];
+        c.heads[index] = b;
+        ++c.counts[index];
+    }
+
+private:
+    struct block
+    {
+        block *next;
+    };
+
+    struct cache
+    {
+        block *heads[SIZE_CLASSES] = {};
+        size_t counts[SIZE_CLASSES] = {};
+
+        ~cache()
+        {
+            for (size_t i = 0; i < SIZE_CLASSES; ++i) {
+                while (block *b = heads[i]) {
+                    heads[i] = b->next;
+                    ::operator delete(b);
+                }
+            }
+        }
+    };
+
+    static cache &local()
+    {
+        static thread_local cache instance;
+        return instance;
+    }
+};
+
+struct frame_allocated
+{
+    static void *operator new(size_t size)              { return coroutine_frame_pool::allocate(size); }
+    static void  operator delete(void *ptr, size_t size) { coroutine_frame_pool::deallocate(ptr, size); }
+};
+
+struct co_task_promise_base : frame_allocated
+{
+    /// resumed by symmetric transfer when the task finishes
+    std::coroutine_handle<> continuation;
+    std::exception_ptr      error;
+
+    struct final_awaiter
+    {
+        bool await_ready() const noexcept { return false; }
+        template<typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            std::coroutine_handle<> next = h.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    final_awaiter       final_suspend() const noexcept   { return {}; }
+    void                unhandled_exception()            { error = std::current_exception(); }
+};
+
+/// pool job resuming a suspended coroutine; when the pool drops it unrun (stop() with
+/// work queued) it still resumes the coroutine, with `*cancelled` set, so the frame is not lost
+class resume_job
+{
+public:
+    resume_job(std::coroutine_handle<> handle, bool *cancelled) : m_handle(handle), m_cancelled(cancelled) {}
+    resume_job(resume_job &&other) noexcept : m_handle(other.m_handle), m_cancelled(other.m_cancelled)
+    {
+        other.m_handle = nullptr;
+    }
+    resume_job(const resume_job &) = delete;
+    resume_job &operator=(const resume_job &) = delete;
+    ~resume_job()
+    {
+        if (!m_handle) return;
+        *m_cancelled = true;
+        std::exchange(m_handle, nullptr).resume();
+    }
+
+    void operator()() { std::exchange(m_handle, nullptr).resume(); }
+    /// the pool refused the job, the awaiter does not suspend at all
+    void release() { m_handle = nullptr; }
+
+private:
+    std::coroutine_handle<> m_handle;
+    bool                   *m_cancelled;
+};
+
+}
+
+/// Lazily started coroutine, runs when awaited and resumes the awaiter on the thread it finished on.
+template<typename T = void>
+class co_task
+{
+public:
+    struct promise_type : detail::co_task_promise_base
+    {
+        std::optional<T> value;
+
+        co_task get_return_object() { return co_task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        template<typename U>
+        void return_value(U &&result) { value.emplace(std::forward<U>(result)); }
+        T result()
+        {
+            if (error) std::rethrow_exception(error);
+            return std::move(*value);
+        }
+    };
+
+    co_task(co_task &&other) noexcept : m_handle(other.m_handle) { other.m_handle = nullptr; }
+    co_task(const co_task &) = delete;
+    co_task &operator=(const co_task &) = delete;
+    ~co_task() { if (m_handle) m_handle.destroy(); }
+
+    auto operator co_await() && noexcept
+    {
+        struct awaiter
+        {
+            std::coroutine_handle<promise_type> handle;
+
+            bool await_ready() const noexcept { return handle.done(); }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+            {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+            T await_resume() { return handle.promise().result(); }
+        };
+        return awaiter{m_handle};
+    }
+
+private:
+    explicit co_task(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+template<>
+struct co_task<void>::promise_type : detail::co_task_promise_base
+{
+    co_task get_return_object() { return co_task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    void return_void() {}
+    void result()
+    {
+        if (error) std::rethrow_exception(error);
+    }
+};
+
+/// submits the resumption as an ordinary job, so coroutine frames and `task` objects share workers
+class ThreadPool::schedule_awaiter
+{
+public:
+    schedule_awaiter(ThreadPool &pool, priority level) : m_pool(pool), m_level(level), m_stopped(false) {}
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        /// the coroutine may already run elsewhere once submitted, touch no members after that
+        detail::resume_job resume(handle, &m_stopped);
+        if (m_pool.submit(std::move(resume), m_level).valid()) return true;
+        resume.release();
+        m_stopped = true;
+        return false;
+    }
+    void await_resume() const
+    {
+        if (m_stopped) throw std::runtime_error("ThreadPool stopped");
+    }
+
+private:
+    ThreadPool &m_pool;
+    priority    m_level;
+    bool        m_stopped;
+};
+
+inline ThreadPool::schedule_awaiter ThreadPool::schedule(priority level)
+{
+    return schedule_awaiter(*this, level);
+}
+
+/// `co_await future` suspends until a submitted job finishes and resumes on the worker that
+/// finished it; the future's single continuation is used for this
+template<typename R>
+auto operator co_await(ThreadPool::future<R> &&result)
+{
+    struct awaiter
+    {
+        ThreadPool::future<R> result;
+        bool                  stopped;
+
+        /// an empty future, e.g. from submit() on a stopping pool, resumes at once with the stopped error
+        bool await_ready()
+        {
+            if (!result.valid()) stopped = true;
+            return stopped || result.is_ready();
+        }
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            ThreadPool *pool = result.pool();
+            ThreadPool::future<void> joined = pool->when_all(&result, &result + 1);
+            if (!joined.valid()) return false;
+            detail::resume_job resume(handle, &stopped);
+            if (std::move(joined).then(std::move(resume)).valid()) return true;
+            resume.release();
+            return false;
+        }
+        R await_resume()
+        {
+            if (stopped) throw std::runtime_error("ThreadPool stopped");
+            return result.get();
+        }
+    };
+    return awaiter{std::move(result), false};
+}
+
+namespace detail {
+
+struct sync_event
+{
+    std::mutex              mutex;
+    std::condition_variable cond;
+    bool                    done = false;
+
+    void set()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        cond.notify_all();
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this]() { return done; });
+    }
+};
+
+struct sync_wait_task
+{
+    struct promise_type : frame_allocated
+    {
+        sync_event *event = nullptr;
+
+        struct final_awaiter
+        {
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<promise_type> h) noexcept { h.promise().event->set(); }
+            void await_resume() const noexcept {}
+        };
+
+        sync_wait_task      get_return_object() { return sync_wait_task{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        std::suspend_always initial_suspend() const noexcept { return {}; }
+        final_awaiter       final_suspend() const noexcept   { return {}; }
+        void                return_void() {}
+        void                unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+template<typename T>
+sync_wait_task make_sync_wait_task(co_task<T> &task, std::optional<T> &value, std::exception_ptr &error)
+{
+    try {
+        value.emplace(co_await std::move(task));
+    } catch (...) {
+        error = std::current_exception();
+    }
+}
+
+inline sync_wait_task make_sync_wait_task(co_task<void> &task, std::optional<bool> &value, std::exception_ptr &error)
+{
+    try {
+        co_await std::move(task);
+        value.emplace(true);
+    } catch (...) {
+        error = std::current_exception();
+    }
+}
+
+struct detached_task
+{
+    struct promise_type : frame_allocated
+    {
+        detached_task      get_return_object() { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept   { return {}; }
+        void               return_void() {}
+        void               unhandled_exception() { std::terminate(); }
+    };
+};
+
+}
+
+/// Block the calling (non-worker) thread until `task` finishes and return its result.
+/// The task starts on the calling thread and usually hops to the pool with `co_await pool.schedule()`.
+template<typename T>
+T sync_wait(co_task<T> &&task)
+{
+    detail::sync_event event;
+    std::optional<typename std::conditional<std::is_void<T>::value, bool, T>::type> value;
+    std::exception_ptr error;
+
+    detail::sync_wait_task wrapper = detail::make_sync_wait_task(task, value, error);
+    wrapper.handle.promise().event = &event;
+    wrapper.handle.resume();
+    event.wait();
+    wrapper.handle.destroy();
+
+    if (error) std::rethrow_exception(error);
+    if constexpr (!std::is_void<T>::value) {
+        return std::move(*value);
+    }
+}
+
+/// Run `task` on the pool without waiting for it. Nobody observes its result,
+/// errors included; await the task instead when they matter.
+inline detail::detached_task co_spawn(ThreadPool &pool, co_task<void> task)
+{
+    try {
+        co_await pool.schedule();
+        co_await std::move(task);
+    } catch (...) {
+    }
+}
+
+}} // namespace
+
+#endif
@@ -0,0 +1,100 @@
+#include "common/CpuTopology.h"
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+namespace sb { namespace common {
+
+namespace {
+
+/// parse kernel cpulist format, e.g. "0-3,8,10-11"
+std::vector<int> parse_cpu_list(const std::string &text)
+{
+    std::vector<int> res;
+    std::stringstream ss(text);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty() || range[0] == '\n') continue;
+        const size_t dash = range.find('-');
+        const int first = std::stoi(range.substr(0, dash));
+        const int last  = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; ++cpu) {
+            res.push_back(cpu);
+        }
+    }
+    return res;
+}
+
+CpuTopology detect()
+{
+    CpuTopology res;
+#ifdef __linux__
+    for (int node = 0; ; ++node) {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!file) break;
+        std::string text;
+        std::getline(file, text);
+        std::vector<int> cpus = parse_cpu_list(text);
+        /// memory-only nodes have no CPUs to run workers on
+        if (!cpus.empty()) res.node_cpus.push_back(cpus);
+    }
+#endif
+    if (res.node_cpus.empty()) {
+        std::vector<int> cpus;
+        const unsigned int count = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned int cpu = 0; cpu < count; ++cpu) {
+            cpus.push_back(static_cast<int>(cpu));
+        }
+        res.node_cpus.push_back(cpus);
+    }
+    return res;
+}
+
+}
+
+const CpuTopology &CpuTopology::get()
+{
+    static const CpuTopology topology = detect();
+    return topology;
+}
+
+bool pin_current_thread(const std::vector<int> &cpus)
+{
+#ifdef __linux__
+    if (cpus.empty()) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE) CPU_SET(cpus[i], &set);
+    }
+    return ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+int memory_node(const void *address)
+{
+#if defined(__linux__) && defined(SYS_get_mempolicy)
+    /// MPOL_F_NODE | MPOL_F_ADDR
+    const unsigned long flags = (1 << 0) | (1 << 1);
+    int node = -1;
+    if (::syscall(SYS_get_mempolicy, &node, nullptr, 0, address, flags) == 0) return node;
+    return -1;
+#else
+    (void)address;
+    return -1;
+#endif
+}
+
+}} // namespace
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "Common.h"
+#include <vector>
+
+namespace sb { namespace common {
+
+/// NUMA nodes and their CPUs as seen by the OS
+struct CpuTopology
+{
+    /// CPUs of every node, a single node with all CPUs when NUMA information is unavailable
+    std::vector<std::vector<int> > node_cpus;
+
+    size_t node_count() const { return node_cpus.size(); }
+
+    /// topology is read once, on first use
+    static const CpuTopology &get();
+};
+
+/// restrict the calling thread to `cpus`, false if unsupported or rejected by the OS
+bool pin_current_thread(const std::vector<int> &cpus);
+
+/// NUMA node holding the page at `address` (touches it first if unmapped), -1 if unknown
+int memory_node(const void *address);
+
+}} // namespace
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "Common.h"
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+namespace sb { namespace common {
+
+/// Log-linear (HDR-style) histogram of nanosecond values, ~6% relative precision over the
+/// whole uint64_t range. Recording is wait-free and meant for a single writer thread,
+/// any thread may take a snapshot concurrently.
+class LatencyHistogram : public noncopyable
+{
+public:
+    /// 2^SUB_BUCKET_BITS linear buckets per power of two
+    static const unsigned SUB_BUCKET_BITS = 4;
+    static const size_t   SUB_BUCKETS     = size_t(1) << SUB_BUCKET_BITS;
+    static const size_t   BUCKET_COUNT    = SUB_BUCKETS + (64 - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+    /// plain copy of the counters, safe to merge and query
+    struct snapshot
+    {
+        std::vector<uint64_t> counts;
+        uint64_t              total;
+        uint64_t              sum;
+        uint64_t              max;
+
+        snapshot() : counts(BUCKET_COUNT, 0), total(0), sum(0), max(0) {}
+
+        void merge(const snapshot &other)
+        {
+            for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+                counts[i] += other.counts[i];
+            }
+            total += other.total;
+            sum   += other.sum;
+            if (other.max > max) max = other.max;
+        }
+
+        uint64_t mean() const { return total ? sum / total : 0; }
+
+        /// lower bound of the bucket holding the `fraction` quantile, e.g. 0.99
+        uint64_t percentile(double fraction) const
+        {
+            if (!total) return 0;
+            uint64_t rank = static_cast<uint64_t>(fraction * static_cast<double>(total));
+            if (rank >= total) rank = total - 1;
+            uint64_t seen = 0;
+            for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+                seen += counts[i];
+                if (seen > rank) return bucket_lower_bound(i);
+            }
+            return max;
+        }
+    };
+
+    LatencyHistogram() : m_total(0), m_sum(0), m_max(0)
+    {
+        for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+            m_counts[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    /// owner thread only
+    void record(uint64_t value)
+    {
+        increment(m_counts[bucket_index(value)], 1);
+        increment(m_total, 1);
+        increment(m_sum, value);
+        if (value > m_max.load(std::memory_order_relaxed)) m_max.store(value, std::memory_order_relaxed);
+    }
+
+    /// any thread; not an atomic cut, counts recorded meanwhile may be partially included
+    snapshot get_snapshot() const
+    {
+        snapshot res;
+        for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+            res.counts[i] = m_counts[i].load(std::memory_order_relaxed);
+        }
+        res.total = m_total.load(std::memory_order_relaxed);
+        res.sum   = m_sum.load(std::memory_order_relaxed);
+        res.max   = m_max.load(std::memory_order_relaxed);
+        return res;
+    }
+
+    static size_t bucket_index(uint64_t value)
+    {
+        if (value < SUB_BUCKETS) return static_cast<size_t>(value);
+        const unsigned msb = 63 - count_leading_zeros(value);
+        const unsigned shift = msb - SUB_BUCKET_BITS;
+        return SUB_BUCKETS + shift * SUB_BUCKETS + static_cast<size_t>((value >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    static uint64_t bucket_lower_bound(size_t index)
+    {
+        if (index < SUB_BUCKETS) return index;
+        const size_t shift = (index - SUB_BUCKETS) / SUB_BUCKETS;
+        return static_cast<uint64_t>(SUB_BUCKETS + (index - SUB_BUCKETS) % SUB_BUCKETS) << shift;
+    }
+
+private:
+    /// single writer, a plain load/store avoids the locked instruction of fetch_add
+    static void increment(std::atomic<uint64_t> &counter, uint64_t value)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    static unsigned count_leading_zeros(uint64_t value)
+    {
+#if defined(__GNUC__)
+        return static_cast<unsigned>(__builtin_clzll(value));
+#else
+        unsigned res = 0;
+        while (!(value & (uint64_t(1) << 63))) {
+            value <<= 1;
+            ++res;
+        }
+        return res;
+#endif
+    }
+
+    std::atomic<uint64_t> m_counts[BUCKET_COUNT];
+    std::atomic<uint64_t> m_total;
+    std::atomic<uint64_t> m_sum;
+    std::atomic<uint64_t> m_max;
+};
+
+}} // namespace
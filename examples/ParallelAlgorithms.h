@@ -0,0 +1,147 @@
+#pragma once
+
+#include "common/ThreadPool.h"
+#include <functional>
+
+namespace sb { namespace common {
+
+namespace detail {
+
+/// chunks per worker when the caller does not give a grain size, enough slack for stealing
+static const size_t PARALLEL_CHUNKS_PER_THREAD = 8;
+
+inline size_t auto_grain(size_t count, size_t threads)
+{
+    const size_t grain = count / (std::max<size_t>(threads, 1) * PARALLEL_CHUNKS_PER_THREAD);
+    return grain ? grain : 1;
+}
+
+/// fork the right half into the local deque, recurse into the left, join the right (runs other jobs meanwhile)
+template<typename Index, typename F>
+void parallel_for_split(ThreadPool &pool, Index first, Index last, size_t grain, F &func)
+{
+    if (static_cast<size_t>(last - first) <= grain) {
+        func(first, last);
+        return;
+    }
+    const Index middle = first + (last - first) / 2;
+    auto right = pool.submit([&pool, middle, last, grain, &func]() {
+        parallel_for_split(pool, middle, last, grain, func);
+    });
+    if (!right.valid()) {
+        parallel_for_split(pool, middle, last, grain, func);
+    }
+    try {
+        parallel_for_split(pool, first, middle, grain, func);
+    } catch (...) {
+        /// right half still references func
+        if (right.valid()) right.wait();
+        throw;
+    }
+    if (right.valid()) right.get();
+}
+
+template<typename T, typename Index, typename Map, typename Combine>
+T parallel_reduce_split(ThreadPool &pool, Index first, Index last, size_t grain, Map &map, Combine &combine)
+{
+    if (static_cast<size_t>(last - first) <= grain) {
+        return map(first, last);
+    }
+    const Index middle = first + (last - first) / 2;
+    auto right = pool.submit([&pool, middle, last, grain, &map, &combine]() {
+        return parallel_reduce_split<T>(pool, middle, last, grain, map, combine);
+    });
+    if (!right.valid()) {
+        T left = parallel_reduce_split<T>(pool, first, middle, grain, map, combine);
+        return combine(std::move(left), parallel_reduce_split<T>(pool, middle, last, grain, map, combine));
+    }
+    try {
+        T left = parallel_reduce_split<T>(pool, first, middle, grain, map, combine);
+        return combine(std::move(left), right.get());
+    } catch (...) {
+        if (right.valid()) right.wait();
+        throw;
+    }
+}
+
+}
+
+/// call `func(begin, end)` for sub-ranges of [first, last) on the pool; chunks are at most
+/// `grain` long (0 - chosen from the range and thread count) and split recursively, so idle
+/// workers steal large halves first. Returns when every chunk is done, rethrows the first error.
+template<typename Index, typename F>
+void parallel_for_range(ThreadPool &pool, Index first, Index last, F &&func, size_t grain = 0)
+{
+    if (!(first < last)) return;
+    if (!grain) grain = detail::auto_grain(static_cast<size_t>(last - first), pool.max_threads());
+
+    if (pool.in_worker_thread()) {
+        detail::parallel_for_split(pool, first, last, grain, func);
+        return;
+    }
+    auto root = pool.submit([&pool, first, last, grain, &func]() {
+        detail::parallel_for_split(pool, first, last, grain, func);
+    });
+    if (root.valid()) {
+        root.get();
+    } else {
+        func(first, last);
+    }
+}
+
+/// call `func(i)` for every i in [first, last) on the pool
+template<typename Index, typename F>
+void parallel_for(ThreadPool &pool, Index first, Index last, F &&func, size_t grain = 0)
+{
+    parallel_for_range(pool, first, last, [&func](Index begin, Index end) {
+        for (Index i = begin; i != end; ++i) {
+            func(i);
+        }
+    }, grain);
+}
+
+/// combine(map(begin, end)...) over sub-ranges of [first, last); `combine` must be associative,
+/// `identity` is returned for an empty range
+template<typename T, typename Index, typename Map, typename Combine>
+T parallel_reduce(ThreadPool &pool, Index first, Index last, T identity, Map &&map, Combine &&combine,
+                  size_t grain = 0)
+{
+    if (!(first < last)) return identity;
+    if (!grain) grain = detail::auto_grain(static_cast<size_t>(last - first), pool.max_threads());
+
+    if (pool.in_worker_thread()) {
+        return detail::parallel_reduce_split<T>(pool, first, last, grain, map, combine);
+    }
+    auto root = pool.submit([&pool, first, last, grain, &map, &combine]() {
+        return detail::parallel_reduce_split<T>(pool, first, last, grain, map, combine);
+    });
+    if (root.valid()) {
+        return root.get();
+    }
+    return map(first, last);
+}
+
+/// run all callables concurrently, the calling thread takes the last one
+template<typename F>
+void parallel_invoke(ThreadPool &, F &&func)
+{
+    func();
+}
+
+template<typename F, typename... Rest>
+void parallel_invoke(ThreadPool &pool, F &&func, Rest &&... rest)
+{
+    auto first = pool.submit(std::ref(func));
+    if (!first.valid()) {
+        func();
+    }
+    try {
+        parallel_invoke(pool, std::forward<Rest>(rest)...);
+    } catch (...) {
+        if (first.valid()) first.wait();
+        throw;
+    }
+    if (first.valid()) first.get();
+}
+
+}} // namespace
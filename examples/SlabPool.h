@@ -0,0 +1,96 @@
+#pragma once
+
+#include "Common.h"
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+
+namespace sb { namespace common {
+
+/// Lock-free pool of preallocated objects, grows by chunks and never frees until destroyed.
+/// T must be default constructible and provide `std::atomic<uint32_t> slab_next` and `uint32_t slab_index`.
+template<typename T>
+class SlabPool : public noncopyable
+{
+public:
+    static const size_t CHUNK_SIZE = 256;
+    static const size_t MAX_CHUNKS = 4096;
+
+    explicit SlabPool(size_t initial = CHUNK_SIZE) : m_chunk_count(0), m_head(0)
+    {
+        std::lock_guard<std::mutex> lock(m_grow_mutex);
+        while (capacity() < initial && add_chunk()) {}
+    }
+
+    /// take a free object, nullptr if pool reached MAX_CHUNKS * CHUNK_SIZE
+    T *acquire()
+    {
+        while (true) {
+            uint64_t head = m_head.load(std::memory_order_acquire);
+            while (uint32_t idx = static_cast<uint32_t>(head)) {
+                T *item = slot(idx - 1);
+                const uint64_t next = ((head >> 32) + 1) << 32 | item->slab_next.load(std::memory_order_relaxed);
+                if (m_head.compare_exchange_weak(head, next, std::memory_order_acquire, std::memory_order_acquire)) {
+                    return item;
+                }
+            }
+            if (!grow()) return nullptr;
+        }
+    }
+
+    /// return object to the pool, any thread
+    void release(T *item)
+    {
+        push_chain(item, item);
+    }
+
+    size_t capacity() const { return m_chunk_count.load() * CHUNK_SIZE; }
+
+private:
+    T *slot(uint32_t index) const
+    {
+        return &m_chunks[index / CHUNK_SIZE][index % CHUNK_SIZE];
+    }
+
+    void push_chain(T *first, T *last)
+    {
+        uint64_t head = m_head.load(std::memory_order_relaxed);
+        uint64_t next;
+        do {
+            last->slab_next.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+            next = ((head >> 32) + 1) << 32 | (first->slab_index + 1);
+        } while (!m_head.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    bool grow()
+    {
+        std::lock_guard<std::mutex> lock(m_grow_mutex);
+        /// somebody else refilled the list while we waited
+        if (static_cast<uint32_t>(m_head.load(std::memory_order_acquire))) return true;
+        return add_chunk();
+    }
+
+    /// m_grow_mutex must be held
+    bool add_chunk()
+    {
+        const size_t chunk = m_chunk_count.load();
+        if (chunk >= MAX_CHUNKS) return false;
+
+        m_chunks[chunk].reset(new T[CHUNK_SIZE]);
+        T *items = m_chunks[chunk].get();
+        for (size_t i = 0; i < CHUNK_SIZE; ++i) {
+            items[i].slab_index = static_cast<uint32_t>(chunk * CHUNK_SIZE + i);
+            items[i].slab_next.store(i + 1 < CHUNK_SIZE ? items[i].slab_index + 2 : 0, std::memory_order_relaxed);
+        }
+        ++m_chunk_count;
+        push_chain(&items[0], &items[CHUNK_SIZE - 1]);
+        return true;
+    }
+
+    std::unique_ptr<T[]>  m_chunks[MAX_CHUNKS];
+    std::atomic<size_t>   m_chunk_count;
+    std::atomic<uint64_t> m_head;
+    std::mutex            m_grow_mutex;
+};
+
+}} // namespace
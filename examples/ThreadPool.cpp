@@ -1,5 +1,15 @@
 #include "common/ThreadPool.h"
+#include "common/CpuTopology.h"
 #include "logger.h"
+#include <algorithm>
+#include <chrono>
+#include <ostream>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
 
 static void print_log(...) {}
 
@@ -34,132 +44,763 @@ inline std::thread::id get_thread_id()
     return std::this_thread::get_id();
 }
 
-ThreadPool::ThreadPool(size_t max_threads) : m_max_threads(max_threads), m_terminating(false),
-                                               m_inprogress(0) {
-    m_threads.reserve(max_threads);
+namespace {
+/// pool and worker index of the current thread, used to route submissions to the local deque
+thread_local const void *tls_pool  = nullptr;
+thread_local size_t      tls_index = 0;
+
+inline uint32_t xorshift(uint32_t &state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+inline uint64_t now_ns()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+/// counters are written by their worker only, no need for a locked add
+inline void increment(std::atomic<uint64_t> &counter, uint64_t value = 1)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+const char *level_name(uint32_t level)
+{
+    static const char *names[] = {"high", "normal", "low"};
+    return level < 3 ? names[level] : "unknown";
+}
+}
+
+ThreadPool::ThreadPool(size_t max_threads) : ThreadPool(options(max_threads)) {
+}
+
+ThreadPool::ThreadPool(const options &opts) : m_jobs(LOCAL_QUEUE_CAPACITY),
+                                               m_options(opts), m_nodes(1), m_start_ns(now_ns()), m_running(0), m_spawned_count(0), m_retired_count(0),
+                                               m_completed_count(0), m_completion_signaled(false), m_completion_fd(-1),
+                                               m_sleeping(0), m_waiters(0), m_terminating(false),
+                                               m_draining(false), m_stop_requested(false),
+                                               m_queued(0), m_inprogress(0), m_pushing(0) {
+    for (size_t i = 0; i < PRIORITY_COUNT; ++i) {
+        m_queued_by_level[i] = 0;
+    }
+    if (m_options.max_threads < 1) m_options.max_threads = 1;
+    if (m_options.min_threads > m_options.max_threads) m_options.min_threads = m_options.max_threads;
+    if (m_options.trace_events) m_options.collect_timings = true;
+
+    /// workers are preallocated so thieves can scan them without a lock
+    m_workers.reserve(m_options.max_threads);
+    for (size_t i = 0; i < m_options.max_threads; ++i) {
+        m_workers.push_back(std::unique_ptr<worker>(new worker()));
+        m_workers.back()->seed = static_cast<uint32_t>(i * 2654435761u + 1);
+        if (m_options.trace_events) {
+            worker_counters &counters = m_workers.back()->counters;
+            const size_t capacity = round_up_pow2(m_options.trace_events);
+            counters.trace.reset(new trace_event[capacity]);
+            counters.trace_mask = capacity - 1;
+        }
+    }
+    place_workers();
+
+    /// shared queues first, then one set per node
+    for (size_t i = 0; i < (m_nodes + 1) * PRIORITY_COUNT; ++i) {
+        m_injection.push_back(std::unique_ptr<BoundedQueue<job> >(new BoundedQueue<job>(GLOBAL_QUEUE_CAPACITY)));
+    }
+#ifdef __linux__
+    m_completion_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    while (m_running.load() < m_options.min_threads) {
+        spawn();
+    }
 }
 
 ThreadPool::~ThreadPool() {
     stop();
+    /// completed tasks nobody processed
+    while (job *j = m_completed.pop()) {
+        j->reset();
+    }
+#ifdef __linux__
+    if (m_completion_fd >= 0) ::close(m_completion_fd);
+#endif
 }
 
-void ThreadPool::process_completed_tasks() {
-    task::list completed;
-    {
-        std::lock_guard<std::mutex> lock(m_mutex);
-        m_completed.swap(completed);
+size_t ThreadPool::process_completed_tasks(size_t max_tasks, unsigned int budget_usecs) {
+    /// rearm before draining, producers after this point signal again
+    m_completion_signaled.store(false);
+#ifdef __linux__
+    uint64_t value;
+    if (m_completion_fd >= 0 && ::read(m_completion_fd, &value, sizeof(value)) < 0) {
+        /// EAGAIN, nothing was signaled
     }
-    for (auto it = completed.begin(); it != completed.end(); ++it) {
-        (*it)->on_post_execute();
-        it->reset();
+#endif
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(budget_usecs);
+    size_t processed = 0;
+    while (processed < max_tasks) {
+        job *completed = m_completed.pop();
+        if (!completed) break;
+        --m_completed_count;
+        job::slot<task::sptr>::get(completed)->on_post_execute();
+        unref_job(completed);
+        ++processed;
+        if (budget_usecs && std::chrono::steady_clock::now() >= deadline) break;
     }
+
+    /// budget exhausted, keep the caller's loop awake for the rest
+    if (m_completed_count.load() > 0) {
+        signal_completion();
+    }
+    return processed;
 }
 
-void ThreadPool::add_task(const task::sptr &task) {
+bool ThreadPool::wait_completed_tasks(unsigned int timeout_usecs) {
+    if (m_completed_count.load() > 0) return true;
+    if (!timeout_usecs) return false;
+#ifdef __linux__
+    if (m_completion_fd >= 0) {
+        pollfd pfd;
+        pfd.fd      = m_completion_fd;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+        ::poll(&pfd, 1, static_cast<int>((timeout_usecs + 999) / 1000));
+        return m_completed_count.load() > 0;
+    }
+#endif
+    std::unique_lock<std::mutex> lock(m_completion_mutex);
+    m_completion_cond.wait_for(lock, std::chrono::microseconds(timeout_usecs),
+                               [this]() { return m_completed_count.load() > 0; });
+    return m_completed_count.load() > 0;
+}
+
+void ThreadPool::place_workers() {
+    const CpuTopology &topology = CpuTopology::get();
+    const std::vector<int> &allowed = m_options.cpu_set;
+
+    /// CPU groups workers are spread over: NUMA nodes limited to the allowed set, or the set itself
+    std::vector<std::vector<int> > groups;
+    if (m_options.numa_aware) {
+        for (size_t n = 0; n < topology.node_count(); ++n) {
+            std::vector<int> cpus;
+            for (size_t c = 0; c < topology.node_cpus[n].size(); ++c) {
+                const int cpu = topology.node_cpus[n][c];
+                if (allowed.empty() || std::find(allowed.begin(), allowed.end(), cpu) != allowed.end()) {
+                    cpus.push_back(cpu);
+                }
+            }
+            if (!cpus.empty()) groups.push_back(cpus);
+        }
+    } else if (!allowed.empty()) {
+        groups.push_back(allowed);
+    }
+    if (groups.empty()) return;
+
+    m_nodes = groups.size();
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        worker &w = *m_workers[i];
+        const std::vector<int> &cpus = groups[i % groups.size()];
+        w.node = static_cast<int>(i % groups.size());
+        if (m_options.pin_each) {
+            w.cpus.assign(1, cpus[(i / groups.size()) % cpus.size()]);
+        } else {
+            w.cpus = cpus;
+        }
+    }
+}
+
+void ThreadPool::add_task(const task::sptr &task, priority level, int node) {
     if (!task) return;
-    if (m_terminating) return;
+    if (!accepting()) {
+        task->cancel();
+        return;
+    }
+    task->m_stop_token = get_stop_token();
+
+    job *j = acquire_job();
+    job::slot<task::sptr>::store(j, task);
+    j->invoke       = [](job *j) { job::slot<task::sptr>::get(j)->do_in_background(); };
+    j->destroy      = &job::slot<task::sptr>::destroy;
+    j->post_execute = true;
+    j->level        = static_cast<uint8_t>(level);
+    j->node         = static_cast<int16_t>(node < 0 ? -1 : node % static_cast<int>(m_nodes));
+    push_job(j);
+}
+
+void ThreadPool::maybe_spawn() {
+    const size_t running = m_running.load();
+    if (running >= m_options.max_threads) return;
+    if (running > 0 && running >= m_options.min_threads) {
+        /// an idle worker picks it up cheaper than a new thread
+        if (m_sleeping.load() > 0) return;
+        if (static_cast<size_t>(std::max(m_queued.load(), 0)) <= running * m_options.spawn_backlog) return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_terminating || m_running.load() >= m_options.max_threads) return;
+    spawn();
+}
+
+ThreadPool::job *ThreadPool::acquire_job() {
+    job *j = m_jobs.acquire();
+    if (!j) {
+        /// every slot is queued, held by a future or waiting for process_completed_tasks;
+        /// waiting could deadlock a caller which is the only one to free them
+        j = new job();
+        j->slab_index = job::HEAP_INDEX;
+    }
+    j->continuation.store(nullptr, std::memory_order_relaxed);
+    j->refs.store(1, std::memory_order_relaxed);
+    j->deps.store(0, std::memory_order_relaxed);
+    j->ready.store(false, std::memory_order_relaxed);
+    return j;
+}
+
+void ThreadPool::release_job(job *j) {
+    j->reset();
+    if (j->slab_index == job::HEAP_INDEX) {
+        delete j;
+        return;
+    }
+    m_jobs.release(j);
+}
+
+void ThreadPool::unref_job(job *j) {
+    if (j->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        release_job(j);
+    }
+}
+
+void ThreadPool::run_job(job *j) {
+    ++m_inprogress;
+    --m_queued;
+    --m_queued_by_level[j->level];
+    /// only workers run jobs, so tls_index names the owner of the counters
+    worker_counters &counters = m_workers[tls_index]->counters;
+    increment(counters.tasks_run);
+    if (m_options.collect_timings) {
+        const uint8_t  level  = j->level;
+        const uint64_t start  = now_ns();
+        const uint64_t waited = start > j->pushed_ns ? start - j->pushed_ns : 0;
+        execute(j);
+        const uint64_t end = now_ns();
+        counters.queue_wait.record(waited);
+        counters.execution.record(end - start);
+        trace(tls_index, trace_event::job_span, start, end, waited, level);
+    } else {
+        execute(j);
+    }
+    --m_inprogress;
+
+    /// wake drain() once the pool runs dry
+    if (m_waiters.load() > 0 && m_queued.load() <= 0 && m_inprogress.load() <= 0) {
+        std::lock_guard<std::mutex> lock(m_wait_mutex);
+        m_wait_cond.notify_all();
+    }
+}
+
+void ThreadPool::execute(job *j) {
+    j->run();
+    if (j->post_execute) {
+        push_completed(j);
+    } else {
+        complete(j);
+    }
+}
+
+void ThreadPool::complete(job *j) {
+    j->ready.store(true);
+    job *continuation = j->continuation.exchange(ready_marker());
+    if (continuation) {
+        resolve_dependency(continuation);
+    }
+    /// pairs with the fence in wait_job
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_waiters.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> lock(m_wait_mutex);
+        m_wait_cond.notify_all();
+    }
+    unref_job(j);
+}
+
+void ThreadPool::abandon(job *j) {
+    if (j->post_execute) {
+        job::slot<task::sptr>::get(j)->cancel();
+        unref_job(j);
+        return;
+    }
+    j->set_exception(std::make_exception_ptr(std::runtime_error("ThreadPool stopped")));
+    complete(j);
+}
+
+void ThreadPool::attach(job *antecedent, job *continuation) {
+    job *expected = nullptr;
+    if (antecedent->continuation.compare_exchange_strong(expected, continuation)) return;
+    if (expected != ready_marker()) {
+        throw std::logic_error("future already has a continuation");
+    }
+    resolve_dependency(continuation);
+}
+
+void ThreadPool::resolve_dependency(job *continuation) {
+    if (continuation->deps.fetch_sub(1) == 1) {
+        push_job(continuation);
+    }
+}
+
+void ThreadPool::wait_job(job *j) {
+    while (!j->ready.load(std::memory_order_acquire)) {
+        if (tls_pool == this) {
+            /// help instead of blocking a worker
+            if (job *other = find_job(tls_index)) {
+                run_job(other);
+            } else {
+                std::this_thread::yield();
+            }
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_wait_mutex);
+        ++m_waiters;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (!j->ready.load()) {
+            m_wait_cond.wait(lock);
+        }
+        --m_waiters;
+    }
+}
+
+void ThreadPool::push_completed(job *j) {
+    ++m_completed_count;
+    m_completed.push(j);
+    signal_completion();
+}
+
+void ThreadPool::signal_completion() {
+    /// one wakeup per drain, not per task
+    if (m_completion_signaled.exchange(true)) return;
+#ifdef __linux__
+    if (m_completion_fd >= 0) {
+        const uint64_t one = 1;
+        if (::write(m_completion_fd, &one, sizeof(one)) < 0) {
+            /// counter overflow is impossible here, the fd is drained on every process_completed_tasks
+        }
+        return;
+    }
+#endif
+    std::lock_guard<std::mutex> lock(m_completion_mutex);
+    m_completion_cond.notify_all();
+}
+
+bool ThreadPool::accepting() const {
+    if (m_terminating) return false;
+    /// while draining only jobs forked by running work get in
+    return !m_draining || tls_pool == this;
+}
+
+void ThreadPool::push_job(job *j) {
+    /// counted before m_terminating is read: either we see the stop or stop() waits for this push
+    ++m_pushing;
+    struct push_guard
     {
+        std::atomic<int> &pushing;
+        ~push_guard() { --pushing; }
+    } guard = {m_pushing};
+    if (m_terminating) {
+        abandon(j);
+        return;
+    }
+    ++m_queued;
+    ++m_queued_by_level[j->level];
+    if (m_options.collect_timings) j->pushed_ns = now_ns();
+    bool pushed = false;
+    if (tls_pool == this && (j->node < 0 || j->node == m_workers[tls_index]->node)) {
+        pushed = m_workers[tls_index]->deques[j->level]->push(j);
+    }
+    while (!pushed) {
+        pushed = injection(j->node, j->level).push(j);
+        if (pushed) break;
+        if (tls_pool == this) {
+            /// both queues are full, a worker must not block on itself
+            run_job(j);
+            return;
+        }
+        if (m_terminating) {
+            --m_queued;
+            --m_queued_by_level[j->level];
+            abandon(j);
+            return;
+        }
+        /// backpressure for external submitters
+        wake_one();
+        std::this_thread::yield();
+    }
+    wake_one();
+    maybe_spawn();
+}
+
+void ThreadPool::wake_one() {
+    /// pairs with the fence in idle_wait: either we see the sleeper or it sees the job
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_sleeping.load(std::memory_order_relaxed) > 0) {
         std::lock_guard<std::mutex> lock(m_mutex);
-        m_pending.push_back(task);
-        if (m_threads.size() < m_max_threads)
-        {
-            spawn();
+        m_cond.notify_one();
+    }
+}
+
+bool ThreadPool::has_pending() const {
+    for (size_t level = 0; level < PRIORITY_COUNT; ++level) {
+        for (int node = -1; node < static_cast<int>(m_nodes); ++node) {
+            if (!injection(node, level).empty()) return true;
+        }
+        for (size_t i = 0; i < m_workers.size(); ++i) {
+            if (!m_workers[i]->deques[level]->empty()) return true;
+        }
+    }
+    return false;
+}
+
+ThreadPool::job *ThreadPool::find_job(size_t index) {
+    worker &self = *m_workers[index];
+
+    /// anti-starvation: a level passed over AGING_THRESHOLD times goes first, lowest level wins
+    for (size_t level = PRIORITY_COUNT; level-- > 1;) {
+        if (self.skipped[level] < AGING_THRESHOLD) continue;
+        self.skipped[level] = 0;
+        if (job *j = take_job(index, level)) return j;
+    }
+
+    for (size_t level = 0; level < PRIORITY_COUNT; ++level) {
+        job *j = take_job(index, level);
+        if (!j) continue;
+        for (size_t lower = level + 1; lower < PRIORITY_COUNT; ++lower) {
+            if (m_queued_by_level[lower].load(std::memory_order_relaxed) > 0) ++self.skipped[lower];
         }
+        return j;
     }
-    m_cond.notify_one();
+    return nullptr;
+}
+
+ThreadPool::job *ThreadPool::take_job(size_t index, size_t level) {
+    worker &self = *m_workers[index];
+    if (job *j = self.deques[level]->pop()) return j;
+    if (job *j = injection(self.node, level).pop()) return j;
+    if (job *j = injection(-1, level).pop()) return j;
+    if (job *j = steal_job(index, level, true)) return j;
+    if (m_nodes < 2) return nullptr;
+
+    /// nothing near us, take work bound to other nodes rather than idle
+    if (job *j = steal_job(index, level, false)) return j;
+    for (size_t n = 1; n < m_nodes; ++n) {
+        if (job *j = injection(static_cast<int>((self.node + n) % m_nodes), level).pop()) return j;
+    }
+    return nullptr;
+}
+
+ThreadPool::job *ThreadPool::steal_job(size_t index, size_t level, bool same_node) {
+    /// steal from a random victim, then scan the rest
+    worker &self = *m_workers[index];
+    const size_t count = m_workers.size();
+    if (count < 2) return nullptr;
+    const size_t first = xorshift(self.seed) % count;
+    uint64_t attempts = 0;
+    job *res = nullptr;
+    for (size_t k = 0; k < count && !res; ++k) {
+        const size_t victim = (first + k) % count;
+        if (victim == index) continue;
+        if ((m_workers[victim]->node == self.node) != same_node) continue;
+        ++attempts;
+        res = m_workers[victim]->deques[level]->steal();
+    }
+    increment(self.counters.steal_attempts, attempts);
+    if (res) increment(self.counters.steals);
+    return res;
+}
+
+bool ThreadPool::idle_wait(size_t index) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    ++m_sleeping;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool timed_out = false;
+    if (!m_terminating && !has_pending()) {
+        const uint64_t start = m_options.collect_timings ? now_ns() : 0;
+        if (m_options.idle_timeout_usecs) {
+            timed_out = m_cond.wait_for(lock, std::chrono::microseconds(m_options.idle_timeout_usecs))
+                        == std::cv_status::timeout;
+        } else {
+            m_cond.wait(lock);
+        }
+        if (m_options.collect_timings) {
+            const uint64_t end = now_ns();
+            increment(m_workers[index]->counters.idle_ns, end - start);
+            trace(index, trace_event::idle_span, start, end, 0, 0);
+        }
+    }
+    --m_sleeping;
+
+    if (!timed_out || m_terminating || m_running.load() <= m_options.min_threads) return true;
+
+    /// pairs with the fence in push_job: either the submitter sees us gone and spawns, or we see its job
+    --m_running;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (has_pending()) {
+        ++m_running;
+        return true;
+    }
+    m_workers[index]->active = false;
+    ++m_retired_count;
+    return false;
+}
+
+void ThreadPool::drop_pending() {
+    /// called after all workers are joined, so owner-only deque ops are safe here
+    for (size_t level = 0; level < PRIORITY_COUNT; ++level) {
+        for (size_t i = 0; i < m_workers.size(); ++i) {
+            while (job *j = m_workers[i]->deques[level]->pop()) {
+                --m_queued;
+                --m_queued_by_level[level];
+                abandon(j);
+            }
+        }
+        for (int node = -1; node < static_cast<int>(m_nodes); ++node) {
+            while (job *j = injection(node, level).pop()) {
+                --m_queued;
+                --m_queued_by_level[level];
+                abandon(j);
+            }
+        }
+    }
+}
+
+bool ThreadPool::drain(unsigned int timeout_usecs) {
+    m_draining = true;
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeout_usecs);
+    bool finished = false;
+    {
+        std::unique_lock<std::mutex> lock(m_wait_mutex);
+        ++m_waiters;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (true) {
+            finished = m_queued.load() <= 0 && m_inprogress.load() <= 0;
+            if (finished || std::chrono::steady_clock::now() >= deadline) break;
+            m_wait_cond.wait_until(lock, deadline);
+        }
+        --m_waiters;
+    }
+    print_log("[sstl_ThreadPool (%)] drain finished %", this, finished);
+    stop();
+    return finished;
 }
 
 void ThreadPool::stop() {
     print_log("[sstl_ThreadPool (%)] stop begin", this);
+    m_stop_requested = true;
     {
         std::lock_guard<std::mutex> lock(m_mutex);
-        m_pending.clear();
         m_terminating = true;
     }
 
-    print_log("[sstl_ThreadPool (%)] cancel tasks ok", this);
-    print_log("[sstl_ThreadPool (%)] count threads %", this, m_threads.size());
+    print_log("[sstl_ThreadPool (%)] count threads %", this, m_running.load());
 
     m_cond.notify_all();
 
     print_log("[sstl_ThreadPool (%)] begin deletions", this);
 
-    for (const auto &tr : m_threads) {
-        tr->join();
+    for (const auto &w : m_workers) {
+        if (!w->thread) continue;
+        w->thread->join();
+        w->thread.reset();
         print_log("[sstl_ThreadPool (%)]  thread finished", this);
     }
-    m_threads.clear();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (const auto &w : m_workers) {
+            w->active = false;
+        }
+        m_running = 0;
+    }
+
+    /// a submitter which passed its m_terminating check before the stop may still be pushing
+    while (m_pushing.load() > 0) {
+        std::this_thread::yield();
+    }
+    drop_pending();
+    print_log("[sstl_ThreadPool (%)] cancel tasks ok", this);
+    const stats totals = get_stats();
+    print_log("[sstl_ThreadPool (%)] tasks run %, steals %", this, totals.total.tasks_run, totals.total.steals);
     //m_completed.clear();
 
     print_log("[sstl_ThreadPool (%)] stop end", this);
 }
 
 
+/// m_mutex must be held
 void ThreadPool::spawn() {
-    std::unique_ptr<std::thread> tr_ptr = std::unique_ptr<std::thread>(
-            new std::thread(bind(&ThreadPool::thread_func, this)));
-    m_threads.push_back(move(tr_ptr));
+    size_t index = 0;
+    while (index < m_workers.size() && m_workers[index]->active) ++index;
+    if (index == m_workers.size()) return;
+
+    worker &w = *m_workers[index];
+    if (w.thread) {
+        /// retired thread, already out of its loop
+        w.thread->join();
+    }
+    w.active = true;
+    ++m_running;
+    ++m_spawned_count;
+    w.thread = std::unique_ptr<std::thread>(
+            new std::thread(bind(&ThreadPool::thread_func, this, index)));
 }
 
-size_t ThreadPool::current_threads() {
-    std::lock_guard<std::mutex> lock(m_mutex);
-    return m_threads.size();
+bool ThreadPool::in_worker_thread() const {
+    return tls_pool == this;
 }
 
-size_t ThreadPool::working_tasks() {
-    std::lock_guard<std::mutex> lock(m_mutex);
-    size_t res = 0;
-    res = m_pending.size() + m_inprogress;
-    return res;
+void ThreadPool::trace(size_t index, trace_event::kind_type kind, uint64_t start_ns, uint64_t end_ns,
+                       uint64_t wait_ns, uint8_t level) {
+    worker_counters &counters = m_workers[index]->counters;
+    if (!counters.trace) return;
+    const uint64_t pos = counters.trace_pos.load(std::memory_order_relaxed);
+    trace_event &e = counters.trace[pos & counters.trace_mask];
+    e.start_ns.store(start_ns, std::memory_order_relaxed);
+    e.duration_ns.store(end_ns - start_ns, std::memory_order_relaxed);
+    e.wait_ns.store(wait_ns, std::memory_order_relaxed);
+    e.kind.store(kind, std::memory_order_relaxed);
+    e.level.store(level, std::memory_order_relaxed);
+    counters.trace_pos.store(pos + 1, std::memory_order_release);
 }
 
-size_t ThreadPool::all_tasks() {
-    std::lock_guard<std::mutex> lock(m_mutex);
-    size_t res = 0;
-    res = m_pending.size() + m_inprogress + m_completed.size();
+void ThreadPool::worker_stats::merge(const worker_stats &other) {
+    tasks_run      += other.tasks_run;
+    steal_attempts += other.steal_attempts;
+    steals         += other.steals;
+    idle_usecs     += other.idle_usecs;
+    queue_wait.merge(other.queue_wait);
+    execution.merge(other.execution);
+}
+
+ThreadPool::stats ThreadPool::get_stats() const {
+    stats res;
+    res.workers.resize(m_workers.size());
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        const worker_counters &counters = m_workers[i]->counters;
+        worker_stats &ws = res.workers[i];
+        ws.tasks_run      = counters.tasks_run.load(std::memory_order_relaxed);
+        ws.steal_attempts = counters.steal_attempts.load(std::memory_order_relaxed);
+        ws.steals         = counters.steals.load(std::memory_order_relaxed);
+        ws.idle_usecs     = counters.idle_ns.load(std::memory_order_relaxed) / 1000;
+        ws.queue_wait     = counters.queue_wait.get_snapshot();
+        ws.execution      = counters.execution.get_snapshot();
+        res.total.merge(ws);
+    }
     return res;
 }
 
-void ThreadPool::thread_func(ThreadPool *_this) {
-    while (true) {
-        /// try quit
-        if (_this->m_terminating) break;
+void ThreadPool::write_chrome_trace(std::ostream &out) const {
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        const worker_counters &counters = m_workers[i]->counters;
+        if (!counters.trace) continue;
+        const uint64_t capacity = counters.trace_mask + 1;
+        const uint64_t end   = counters.trace_pos.load(std::memory_order_acquire);
+        const uint64_t begin = end > capacity ? end - capacity : 0;
 
-        task::sptr task_;
-        /// extract task
+        struct span
         {
-            /// manual acquire/release with non-scope logick
-            std::unique_lock<std::mutex> lock(_this->m_mutex);
-            /// wait new task
-            if (_this->m_pending.empty()) {
-                _this->m_cond.wait(lock);
-            }
+            uint64_t pos, start, duration, wait;
+            uint32_t kind, level;
+        };
+        std::vector<span> spans;
+        spans.reserve(static_cast<size_t>(end - begin));
+        for (uint64_t pos = begin; pos < end; ++pos) {
+            const trace_event &e = counters.trace[pos & counters.trace_mask];
+            span s;
+            s.pos      = pos;
+            s.start    = e.start_ns.load(std::memory_order_relaxed);
+            s.duration = e.duration_ns.load(std::memory_order_relaxed);
+            s.wait     = e.wait_ns.load(std::memory_order_relaxed);
+            s.kind     = e.kind.load(std::memory_order_relaxed);
+            s.level    = e.level.load(std::memory_order_relaxed);
+            spans.push_back(s);
+        }
+        /// seqlock-style check: slots the worker reached meanwhile may be torn
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const uint64_t now = counters.trace_pos.load(std::memory_order_relaxed);
 
-            if (_this->m_terminating) {
-                break;
+        for (size_t k = 0; k < spans.size(); ++k) {
+            const span &s = spans[k];
+            if (s.pos + capacity <= now || s.start < m_start_ns) continue;
+            const bool idle = s.kind == trace_event::idle_span;
+            const uint64_t ts = s.start - m_start_ns;
+            out << (first ? "" : ",") << "\n{\"name\":\"" << (idle ? "idle" : "job")
+                << "\",\"cat\":\"" << (idle ? "idle" : level_name(s.level))
+                << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << i
+                << ",\"ts\":" << ts / 1000 << "." << ts % 1000 / 100
+                << ",\"dur\":" << s.duration / 1000 << "." << s.duration % 1000 / 100;
+            if (!idle) {
+                out << ",\"args\":{\"queue_wait_us\":" << s.wait / 1000 << "}";
             }
+            out << "}";
+            first = false;
+        }
+    }
+    out << "\n]}\n";
+}
 
-            if (_this->m_pending.empty()) {
-                continue;
-            }
+size_t ThreadPool::current_threads() {
+    return m_running.load();
+}
 
-            task_ = _this->m_pending.front();
-            _this->m_pending.pop_front();
-            ++_this->m_inprogress;
-        }
+size_t ThreadPool::spawned_threads() {
+    return m_spawned_count.load();
+}
 
-        task_->do_in_background();
+size_t ThreadPool::retired_threads() {
+    return m_retired_count.load();
+}
 
-        /// store task
-        {
-            std::lock_guard<std::mutex> lock(_this->m_mutex);
-            --_this->m_inprogress;
-            _this->m_completed.push_back(task_);
-        }
+size_t ThreadPool::working_tasks() {
+    return m_queued + m_inprogress;
+}
 
-    }
+size_t ThreadPool::queued_tasks(priority level) {
+    const int res = m_queued_by_level[static_cast<size_t>(level)].load();
+    return res > 0 ? res : 0;
 }
-}}
 
+size_t ThreadPool::all_tasks() {
+    size_t res = 0;
+    res = m_queued + m_inprogress + m_completed_count;
+    return res;
+}
+
+void ThreadPool::thread_func(ThreadPool *_this, size_t index) {
+    tls_pool  = _this;
+    tls_index = index;
+    if (!_this->m_workers[index]->cpus.empty()) {
+        pin_current_thread(_this->m_workers[index]->cpus);
+    }
+
+    while (true) {
+        /// try quit
+        if (_this->m_terminating) break;
 
+        /// extract task
+        job *j = _this->find_job(index);
+        if (!j) {
+            /// wait new task, leave if retired
+            if (!_this->idle_wait(index)) break;
+            continue;
+        }
+        /// run and store task
+        _this->run_job(j);
+    }
 
+    tls_pool = nullptr;
+}
+}}
@@ -1,24 +1,98 @@
 #pragma once
 
 #include "Common.h"
+#include "common/ConcurrentQueues.h"
+#include "common/SlabPool.h"
+#include "common/LatencyHistogram.h"
 #include <vector>
 #include <list>
+#include <iosfwd>
 #include <thread>
 #include <condition_variable>
+#include <exception>
 
 namespace sb { namespace common {
 
 extern inline void usleep(unsigned int usecs);
 extern inline std::thread::id get_thread_id();
 
+namespace detail {
+
+template<typename R, typename F>
+struct then_result
+{
+    using type = typename std::decay<decltype(std::declval<F&>()(std::declval<R>()))>::type;
+};
+
+template<typename F>
+struct then_result<void, F>
+{
+    using type = typename std::decay<decltype(std::declval<F&>()())>::type;
+};
+
+template<typename R, typename F>
+struct continuation;
+
+}
+
 class ThreadPool : public noncopyable
 {
 public:
+    struct options
+    {
+        /// workers kept alive even when idle, started by the constructor
+        size_t       min_threads;
+        size_t       max_threads;
+        /// an idle worker above min_threads retires after this, 0 - never
+        unsigned int idle_timeout_usecs;
+        /// spawn another worker only when queued jobs per running worker exceed this
+        size_t       spawn_backlog;
+        /// CPUs workers may run on, empty - no restriction
+        std::vector<int> cpu_set;
+        /// pin every worker to a single CPU instead of the whole allowed set
+        bool         pin_each;
+        /// spread workers over NUMA nodes, a worker stays on the CPUs of its node
+        bool         numa_aware;
+        /// read the clock around every job for queue wait / execution histograms and idle time
+        bool         collect_timings;
+        /// per-worker ring of recent job and idle spans for write_chrome_trace(), 0 - off;
+        /// implies collect_timings
+        size_t       trace_events;
+
+        explicit options(size_t threads_count = 2)
+            : min_threads(0), max_threads(threads_count), idle_timeout_usecs(0), spawn_backlog(0),
+              pin_each(false), numa_aware(false), collect_timings(false), trace_events(0) {}
+    };
+
     explicit ThreadPool(size_t threads_count = 2);
+    explicit ThreadPool(const options &opts);
     ~ThreadPool();
 
     void do_in_main_thread();
 
+    /// scheduling class, workers serve higher levels first
+    enum class priority
+    {
+        high,   ///< latency-sensitive requests
+        normal,
+        low     ///< bulk background work
+    };
+    static const size_t PRIORITY_COUNT = 3;
+
+    /// cheap copyable view of the pool stop flag, long-running jobs should poll it and return early
+    class stop_token
+    {
+    public:
+        stop_token() : m_flag(nullptr) {}
+        bool stop_requested() const { return m_flag && m_flag->load(std::memory_order_relaxed); }
+
+    private:
+        friend class ThreadPool;
+        explicit stop_token(const std::atomic<bool> *flag) : m_flag(flag) {}
+
+        const std::atomic<bool> *m_flag;
+    };
+
     struct task : public noncopyable
     {
         using sptr = std::shared_ptr<task>;
@@ -26,31 +100,498 @@ public:
 
         virtual void do_in_background() = 0;
         virtual void on_post_execute() {}
+        /// called instead of do_in_background when the pool drops the task
         virtual void cancel()          {}
         virtual ~task()                {}
+
+        /// the pool is stopping, do_in_background should finish as soon as possible
+        bool stop_requested() const { return m_stop_token.stop_requested(); }
+
+    private:
+        friend class ThreadPool;
+        stop_token m_stop_token;
     };
 
-    void   add_task(const task::sptr &task);
+    template<typename R>
+    class future;
+
+    /// counters of one worker, histograms are empty unless options::collect_timings
+    struct worker_stats
+    {
+        uint64_t tasks_run;
+        /// victim deques probed / successful steals
+        uint64_t steal_attempts;
+        uint64_t steals;
+        uint64_t idle_usecs;
+        /// nanoseconds from push to start of the job
+        LatencyHistogram::snapshot queue_wait;
+        /// nanoseconds spent running the job, including jobs it helped with while waiting
+        LatencyHistogram::snapshot execution;
+
+        worker_stats() : tasks_run(0), steal_attempts(0), steals(0), idle_usecs(0) {}
+        void merge(const worker_stats &other);
+    };
+
+    struct stats
+    {
+        std::vector<worker_stats> workers;
+        worker_stats              total;
+    };
+
+    /// `node` - preferred NUMA node of the task (see memory_node()), -1 - any;
+    /// a node-bound task may still run elsewhere when its node has no idle worker
+    void   add_task(const task::sptr &task, priority level = priority::normal, int node = -1);
+    /// run callable on a worker; callables up to job::INLINE_SIZE bytes are stored
+    /// in a preallocated slot, so steady-state submission does not touch the heap.
+    /// The returned future shares that slot, dropping it makes the call fire-and-forget.
+    template<typename F>
+    future<typename std::decay<decltype(std::declval<F&>()())>::type> submit(F &&func, priority level = priority::normal,
+                                                                             int node = -1);
+    /// future which becomes ready when every future in [first, last) is ready;
+    /// results and exceptions stay in the original futures. Throws std::logic_error,
+    /// leaving the futures untouched, if one of them already has a continuation
+    template<typename Iterator>
+    future<void> when_all(Iterator first, Iterator last);
+    /// request stop of running jobs, cancel() every queued task and join workers;
+    /// completed tasks can still be processed afterwards
     void   stop();
-    void   process_completed_tasks();
+    /// refuse new submissions from outside the pool, wait up to `timeout_usecs` for queued
+    /// and running work to finish, then stop(); true if everything finished in time
+    bool   drain(unsigned int timeout_usecs);
+    stop_token get_stop_token() const { return stop_token(&m_stop_requested); }
+
+    /// `co_await pool.schedule()` moves a coroutine onto a worker, see common/Coroutine.h
+    class schedule_awaiter;
+    schedule_awaiter schedule(priority level = priority::normal);
+    /// run on_post_execute of completed tasks on the calling thread, one consumer at a time.
+    /// Stops after `max_tasks` callbacks or once `budget_usecs` elapsed (0 - no time limit),
+    /// returns number of callbacks run
+    size_t process_completed_tasks(size_t max_tasks = SIZE_MAX, unsigned int budget_usecs = 0);
+    /// block up to `timeout_usecs` until completed tasks exist, true if there are some
+    bool   wait_completed_tasks(unsigned int timeout_usecs);
+    /// descriptor which becomes readable when completed tasks exist, for the caller's
+    /// own poll/epoll loop; -1 where eventfd is not available
+    int    completion_fd() const { return m_completion_fd; }
     size_t current_threads();
+    /// workers started / retired by idle timeout since construction
+    size_t spawned_threads();
+    size_t retired_threads();
     size_t working_tasks();
     size_t all_tasks();
+    /// queue depth of one priority level
+    size_t queued_tasks(priority level);
+    /// worker groups, 1 unless options::numa_aware
+    size_t numa_nodes() const { return m_nodes; }
+    size_t max_threads() const { return m_options.max_threads; }
+    /// true on a worker of this pool, where waiting on a future runs other jobs
+    bool   in_worker_thread() const;
+    /// read counters without stopping workers, values are a close but not atomic cut
+    stats  get_stats() const;
+    /// dump traced spans in Chrome trace event format (chrome://tracing, Perfetto)
+    void   write_chrome_trace(std::ostream &out) const;
+
+    /// per-worker deque capacity, overflow goes to the global queue
+    static const size_t LOCAL_QUEUE_CAPACITY  = 1024;
+    /// global injection queue capacity for submitters outside the pool
+    static const size_t GLOBAL_QUEUE_CAPACITY = 1024 * 8;
+    /// a waiting level is served first after this many jobs of higher levels
+    static const uint32_t AGING_THRESHOLD     = 16;
 
 private:
-    static void thread_func(ThreadPool *_this);
+    /// queue node with inline storage for the callable and later its result,
+    /// recycled through m_jobs once the executor and all futures dropped it
+    struct job
+    {
+        static const size_t INLINE_SIZE = 64;
+        /// slab_index of a job allocated on the heap because the slab is exhausted
+        static const uint32_t HEAP_INDEX = UINT32_MAX;
+
+        template<typename T>
+        struct fits : std::integral_constant<bool, sizeof(T) <= INLINE_SIZE && alignof(T) <= 16> {};
+
+        /// typed access to the storage, values too large for it are boxed on the heap
+        template<typename T, bool Inline = fits<T>::value>
+        struct slot
+        {
+            template<typename A>
+            static void store(job *j, A &&value) { new (j->data()) T(std::forward<A>(value)); }
+            static T   &get(job *j)              { return *static_cast<T *>(j->data()); }
+            static void destroy(job *j)          { get(j).~T(); }
+        };
+
+        template<typename T>
+        struct slot<T, false>
+        {
+            template<typename A>
+            static void store(job *j, A &&value) { new (j->data()) T*(new T(std::forward<A>(value))); }
+            static T   &get(job *j)              { return **static_cast<T **>(j->data()); }
+            static void destroy(job *j)          { delete *static_cast<T **>(j->data()); }
+        };
+
+        template<typename R, typename T>
+        struct invoker;
+
+        void                (*invoke)(job *) = nullptr;
+        void                (*destroy)(job *) = nullptr;
+        std::atomic<job *>    next;
+        std::atomic<job *>    continuation;
+        std::atomic<uint32_t> refs;
+        std::atomic<int32_t>  deps;
+        std::atomic<bool>     ready;
+        std::atomic<uint32_t> slab_next;
+        uint32_t              slab_index = 0;
+        bool                  post_execute = false;
+        bool                  failed = false;
+        uint8_t               level = 0;
+        int16_t               node = -1;
+        /// steady clock of the last push_job, set only when collecting timings
+        uint64_t              pushed_ns = 0;
+        alignas(16) unsigned char storage[INLINE_SIZE];
+
+        void *data() { return storage; }
+        void run()   { invoke(this); }
+        void reset()
+        {
+            if (destroy) destroy(this);
+            invoke       = nullptr;
+            destroy      = nullptr;
+            next.store(nullptr, std::memory_order_relaxed);
+            post_execute = false;
+            failed       = false;
+        }
+
+        /// store callable, running it leaves its result or exception in the storage
+        template<typename R, typename F>
+        void bind(F &&func)
+        {
+            using func_type = typename std::decay<F>::type;
+            slot<func_type>::store(this, std::forward<F>(func));
+            invoke  = &invoker<R, func_type>::run;
+            destroy = &slot<func_type>::destroy;
+        }
+
+        void set_exception(const std::exception_ptr &error)
+        {
+            if (destroy) destroy(this);
+            slot<std::exception_ptr>::store(this, error);
+            destroy = &slot<std::exception_ptr>::destroy;
+            failed  = true;
+        }
+    };
+
+    /// span of a job or an idle wait; fields are atomics so the exporter may read a slot
+    /// while its worker overwrites it, torn slots are discarded by the ring position check
+    struct trace_event
+    {
+        enum kind_type { job_span, idle_span };
+
+        std::atomic<uint64_t> start_ns;
+        std::atomic<uint64_t> duration_ns;
+        std::atomic<uint64_t> wait_ns;
+        std::atomic<uint32_t> kind;
+        std::atomic<uint32_t> level;
+    };
+
+    /// written only by the owning worker thread
+    struct worker_counters
+    {
+        worker_counters() : tasks_run(0), steal_attempts(0), steals(0), idle_ns(0), trace_pos(0), trace_mask(0) {}
+
+        std::atomic<uint64_t>          tasks_run;
+        std::atomic<uint64_t>          steal_attempts;
+        std::atomic<uint64_t>          steals;
+        std::atomic<uint64_t>          idle_ns;
+        LatencyHistogram               queue_wait;
+        LatencyHistogram               execution;
+        std::unique_ptr<trace_event[]> trace;
+        std::atomic<uint64_t>          trace_pos;
+        size_t                         trace_mask;
+    };
+
+    struct worker : public noncopyable
+    {
+        worker() : seed(0), active(false), node(0)
+        {
+            for (size_t i = 0; i < PRIORITY_COUNT; ++i) {
+                deques[i].reset(new WorkStealingDeque<job>(LOCAL_QUEUE_CAPACITY));
+                skipped[i] = 0;
+            }
+        }
+
+        std::unique_ptr<WorkStealingDeque<job> > deques[PRIORITY_COUNT];
+        std::unique_ptr<std::thread>             thread;
+        uint32_t                                 seed;
+        /// has a running thread, guarded by m_mutex
+        bool                                     active;
+        int                                      node;
+        /// affinity applied by the thread itself, empty - none
+        std::vector<int>                         cpus;
+        /// jobs of higher levels served while this level was waiting
+        uint32_t                                 skipped[PRIORITY_COUNT];
+        worker_counters                          counters;
+    };
+
+    static void thread_func(ThreadPool *_this, size_t index);
     void spawn();
+    void maybe_spawn();
+    /// never fails, jobs come from the heap once the slab is exhausted
+    job *acquire_job();
+    void release_job(job *j);
+    void unref_job(job *j);
+    bool accepting() const;
+    void push_job(job *j);
+    void run_job(job *j);
+    void execute(job *j);
+    void complete(job *j);
+    void abandon(job *j);
+    void attach(job *antecedent, job *continuation);
+    void resolve_dependency(job *continuation);
+    void wait_job(job *j);
+    void push_completed(job *j);
+    void signal_completion();
+    /// continuation value of a job which already completed
+    static job *ready_marker() { static job marker; return &marker; }
+    /// a continuation other than the ready marker is attached; checked before binding anything,
+    /// since a failed attach could not give back what was moved into the continuation
+    static bool has_continuation(job *j)
+    {
+        job *continuation = j->continuation.load(std::memory_order_acquire);
+        return continuation && continuation != ready_marker();
+    }
+    job *find_job(size_t index);
+    job *take_job(size_t index, size_t level);
+    job *steal_job(size_t index, size_t level, bool same_node);
+    void place_workers();
+    /// injection queue of a node, -1 - shared one
+    BoundedQueue<job> &injection(int node, size_t level) const
+    {
+        return *m_injection[static_cast<size_t>(node + 1) * PRIORITY_COUNT + level];
+    }
+    bool has_pending() const;
+    void wake_one();
+    bool idle_wait(size_t index);
+    void drop_pending();
+    void trace(size_t index, trace_event::kind_type kind, uint64_t start_ns, uint64_t end_ns,
+               uint64_t wait_ns, uint8_t level);
 
-    std::vector<std::unique_ptr<std::thread> > m_threads;
+    std::vector<std::unique_ptr<worker> > m_workers;
+    std::vector<std::unique_ptr<BoundedQueue<job> > > m_injection;
+    SlabPool<job>                         m_jobs;
 
-    size_t                  m_max_threads;
-    task::list              m_pending;
-    task::list              m_completed;
+    options                 m_options;
+    size_t                  m_nodes;
+    /// steady clock at construction, origin of trace timestamps
+    uint64_t                m_start_ns;
+    std::atomic<size_t>     m_running;
+    std::atomic<size_t>     m_spawned_count;
+    std::atomic<size_t>     m_retired_count;
+    IntrusiveMpscQueue<job> m_completed;
+    std::atomic<size_t>     m_completed_count;
+    std::atomic<bool>       m_completion_signaled;
+    int                     m_completion_fd;
+    std::mutex              m_completion_mutex;
+    std::condition_variable m_completion_cond;
     std::mutex              m_mutex;
     std::condition_variable m_cond;
+    std::atomic<int>        m_sleeping;
+    std::mutex              m_wait_mutex;
+    std::condition_variable m_wait_cond;
+    std::atomic<int>        m_waiters;
     std::atomic<bool>       m_terminating;
+    std::atomic<bool>       m_draining;
+    std::atomic<bool>       m_stop_requested;
+    std::atomic<int>        m_queued;
+    std::atomic<int>        m_queued_by_level[PRIORITY_COUNT];
     std::atomic<int>        m_inprogress;
+    /// push_job calls in progress, stop() drains the queues once they are over
+    std::atomic<int>        m_pushing;
 };
 
-}} // namespace
+/// Result handle of ThreadPool::submit, move-only.
+/// A future may have one continuation, attached either by then() or when_all().
+template<typename R>
+class ThreadPool::future
+{
+public:
+    using value_type = R;
+
+    future() : m_pool(nullptr), m_job(nullptr) {}
+    future(future &&other) : m_pool(other.m_pool), m_job(other.m_job) { other.m_job = nullptr; }
+    future &operator=(future &&other)
+    {
+        if (this != &other) {
+            reset();
+            m_pool = other.m_pool;
+            m_job  = other.m_job;
+            other.m_job = nullptr;
+        }
+        return *this;
+    }
+    future(const future &) = delete;
+    future &operator=(const future &) = delete;
+    ~future() { reset(); }
+
+    bool valid() const    { return m_job != nullptr; }
+    ThreadPool *pool() const { return m_pool; }
+    bool is_ready() const { return m_job && m_job->ready.load(std::memory_order_acquire); }
+
+    /// block until ready; a worker thread keeps running other jobs meanwhile
+    void wait() const
+    {
+        if (!m_job) throw std::logic_error("wait on empty future");
+        m_pool->wait_job(m_job);
+    }
+
+    /// wait and move the result out, rethrows exception of the callable
+    R get()
+    {
+        wait();
+        if (m_job->failed) std::rethrow_exception(job::template slot<std::exception_ptr>::get(m_job));
+        return get_value(std::is_void<R>());
+    }
+
+    /// run `func(result)` (or `func()` for future<void>) on a worker once ready,
+    /// consumes this future; throws std::logic_error, leaving it intact, if it already has a continuation
+    template<typename F>
+    future<typename detail::then_result<R, F>::type> then(F &&func);
+
+private:
+    friend class ThreadPool;
+
+    future(ThreadPool *pool, job *j) : m_pool(pool), m_job(j) {}
+
+    R    get_value(std::false_type) { return std::move(job::template slot<R>::get(m_job)); }
+    void get_value(std::true_type)  {}
+
+    void reset()
+    {
+        if (m_job) m_pool->unref_job(m_job);
+        m_job = nullptr;
+    }
+
+    ThreadPool *m_pool;
+    job        *m_job;
+};
 
+template<typename R, typename T>
+struct ThreadPool::job::invoker
+{
+    static void run(job *j)
+    {
+        try {
+            R result = slot<T>::get(j)();
+            slot<T>::destroy(j);
+            j->destroy = nullptr;
+            slot<R>::store(j, std::move(result));
+            j->destroy = &slot<R>::destroy;
+        } catch (...) {
+            j->set_exception(std::current_exception());
+        }
+    }
+};
+
+template<typename T>
+struct ThreadPool::job::invoker<void, T>
+{
+    static void run(job *j)
+    {
+        try {
+            slot<T>::get(j)();
+            slot<T>::destroy(j);
+            j->destroy = nullptr;
+        } catch (...) {
+            j->set_exception(std::current_exception());
+        }
+    }
+};
+
+namespace detail {
+
+/// callable of a then() job: owns the antecedent future and the user functor
+template<typename R, typename F>
+struct continuation
+{
+    ThreadPool::future<R> prev;
+    F                     func;
+
+    auto operator()() -> decltype(func(prev.get())) { return func(prev.get()); }
+};
+
+template<typename F>
+struct continuation<void, F>
+{
+    ThreadPool::future<void> prev;
+    F                        func;
+
+    auto operator()() -> decltype(func())
+    {
+        prev.get();
+        return func();
+    }
+};
+
+}
+
+template<typename F>
+ThreadPool::future<typename std::decay<decltype(std::declval<F&>()())>::type> ThreadPool::submit(F &&func, priority level, int node) {
+    using result_type = typename std::decay<decltype(std::declval<F&>()())>::type;
+    if (!accepting()) return future<result_type>();
+
+    job *j = acquire_job();
+    j->template bind<result_type>(std::forward<F>(func));
+    j->level = static_cast<uint8_t>(level);
+    j->node  = static_cast<int16_t>(node < 0 ? -1 : node % static_cast<int>(m_nodes));
+    /// one reference for the executor, one for the future
+    j->refs.store(2, std::memory_order_relaxed);
+    j->deps.store(0, std::memory_order_relaxed);
+    future<result_type> res(this, j);
+    push_job(j);
+    return res;
+}
+
+template<typename Iterator>
+ThreadPool::future<void> ThreadPool::when_all(Iterator first, Iterator last) {
+    for (Iterator it = first; it != last; ++it) {
+        if (it->valid() && has_continuation(it->m_job)) throw std::logic_error("future already has a continuation");
+    }
+    job *j = acquire_job();
+    j->template bind<void>([]() {});
+    j->level = static_cast<uint8_t>(priority::normal);
+    j->node  = -1;
+    j->refs.store(2, std::memory_order_relaxed);
+    /// extra dependency keeps the join from firing while we attach
+    j->deps.store(1, std::memory_order_relaxed);
+    for (; first != last; ++first) {
+        if (!first->valid()) continue;
+        j->deps.fetch_add(1);
+        attach(first->m_job, j);
+    }
+    future<void> res(this, j);
+    resolve_dependency(j);
+    return res;
+}
+
+template<typename R>
+template<typename F>
+ThreadPool::future<typename detail::then_result<R, F>::type> ThreadPool::future<R>::then(F &&func) {
+    using result_type = typename detail::then_result<R, F>::type;
+    using func_type   = detail::continuation<R, typename std::decay<F>::type>;
+    if (!m_job) throw std::logic_error("then on empty future");
+    if (ThreadPool::has_continuation(m_job)) throw std::logic_error("future already has a continuation");
+
+    ThreadPool *pool = m_pool;
+    job *antecedent  = m_job;
+    job *j = pool->acquire_job();
+    const uint8_t level = antecedent->level;
+    const int16_t node  = antecedent->node;
+    j->template bind<result_type>(func_type{std::move(*this), std::forward<F>(func)});
+    j->level = level;
+    j->node  = node;
+    j->refs.store(2, std::memory_order_relaxed);
+    j->deps.store(1, std::memory_order_relaxed);
+    future<result_type> res(pool, j);
+    pool->attach(antecedent, j);
+    return res;
+}
+
+}} // namespace
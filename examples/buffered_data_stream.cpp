@@ -0,0 +1,280 @@
+#include "filesystem/buffered_data_stream.h"
+#include <cstdlib>
+#include <new>
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+namespace sb { namespace filesystem {
+
+namespace {
+
+uint8_t* allocateAligned(size_t size)
+{
+#ifdef _MSC_VER
+    void* memory = _aligned_malloc(size, AlignedBufferPool::ALIGNMENT);
+    if (!memory)
+        throw std::bad_alloc();
+#else
+    void* memory = nullptr;
+    if (posix_memalign(&memory, AlignedBufferPool::ALIGNMENT, size))
+        throw std::bad_alloc();
+#endif
+    return static_cast<uint8_t*>(memory);
+}
+
+void freeAligned(uint8_t* buffer)
+{
+#ifdef _MSC_VER
+    _aligned_free(buffer);
+#else
+    free(buffer);
+#endif
+}
+
+}
+
+AlignedBufferPool::~AlignedBufferPool()
+{
+    trim();
+}
+
+AlignedBufferPool::sptr AlignedBufferPool::instance()
+{
+    // initialization of a function-local static is thread-safe
+    static AlignedBufferPool::sptr _instance(new AlignedBufferPool());
+    return _instance;
+}
+
+uint8_t* AlignedBufferPool::acquire(size_t size)
+{
+    size = roundSize(size);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = freeBuffers.find(size);
+        if (it != freeBuffers.end() && !it->second.empty())
+        {
+            uint8_t* res = it->second.back();
+            it->second.pop_back();
+            cachedBytes -= size;
+            return res;
+        }
+    }
+    return allocateAligned(size);
+}
+
+void AlignedBufferPool::release(uint8_t* buffer, size_t size)
+{
+    if (!buffer)
+        return;
+    size = roundSize(size);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (cachedBytes + size <= MAX_CACHED_BYTES)
+        {
+            freeBuffers[size].push_back(buffer);
+            cachedBytes += size;
+            return;
+        }
+    }
+    freeAligned(buffer);
+}
+
+void AlignedBufferPool::trim()
+{
+    std::map<size_t, std::vector<uint8_t*>> taken;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        taken.swap(freeBuffers);
+        cachedBytes = 0;
+    }
+    for (auto& sized : taken)
+        for (uint8_t* buffer : sized.second)
+            freeAligned(buffer);
+}
+
+BufferedDataStream::BufferedDataStream(const DataStream::sptr& streamParam, size_t bufferSizeParam,
+                                       const AlignedBufferPool::sptr& poolParam) :
+    stream(streamParam),
+    pool(poolParam),
+    buffer(nullptr),
+    bufferSize(AlignedBufferPool::roundSize(bufferSizeParam)),
+    bufferBase(streamParam ? streamParam->tell() : 0),
+    bufferPos(0),
+    bufferEnd(0),
+    writing(false)
+{
+    if (!stream)
+        throw std::invalid_argument("BufferedDataStream needs a stream");
+    buffer = pool->acquire(bufferSize);
+}
+
+BufferedDataStream::~BufferedDataStream()
+{
+    flush();
+    pool->release(buffer, bufferSize);
+}
+
+size_t BufferedDataStream::readSlow(uint8_t* to, size_t size)
+{
+    if (writing)
+    {
+        flush();
+        writing = false;
+    }
+
+    size_t done = std::min(size, bufferEnd - bufferPos);
+    memcpy(to, buffer + bufferPos, done);
+    bufferPos += done;
+    if (done == size)
+        return done;
+
+    if (size - done >= bufferSize)
+    {
+        // large reads bypass the buffer
+        bufferBase += bufferEnd;
+        bufferPos = bufferEnd = 0;
+        size_t readed = stream->read(to + done, size - done);
+        bufferBase += readed;
+        return done + readed;
+    }
+
+    if (!refill())
+        return done;
+    size_t chunk = std::min(size - done, bufferEnd);
+    memcpy(to + done, buffer, chunk);
+    bufferPos = chunk;
+    return done + chunk;
+}
+
+bool BufferedDataStream::refill()
+{
+    bufferBase += bufferEnd;
+    bufferPos = 0;
+    bufferEnd = stream->read(buffer, bufferSize);
+    return bufferEnd != 0;
+}
+
+void BufferedDataStream::discardReadBuffer()
+{
+    if (bufferPos != bufferEnd)
+        stream->seek(bufferBase + bufferPos, false);
+    bufferBase += bufferPos;
+    bufferPos = bufferEnd = 0;
+}
+
+size_t BufferedDataStream::writeSlow(const uint8_t* from, size_t size)
+{
+    if (!writing)
+    {
+        discardReadBuffer();
+        writing = true;
+    }
+
+    if (size > bufferSize - bufferPos && !flush())
+        return 0;
+    if (size >= bufferSize)
+    {
+        size_t written = stream->write(const_cast<uint8_t*>(from), size);
+        bufferBase += written;
+        return written;
+    }
+
+    memcpy(buffer + bufferPos, from, size);
+    bufferPos += size;
+    return size;
+}
+
+bool BufferedDataStream::flush()
+{
+    if (!writing || !bufferPos)
+        return true;
+    size_t written = stream->write(buffer, bufferPos);
+    bool res = written == bufferPos;
+    // a short write loses the rest, as with an unbuffered stream
+    bufferBase += written;
+    bufferPos = 0;
+    return res;
+}
+
+const uint8_t* BufferedDataStream::readDirect(size_t& size)
+{
+    size = 0;
+    if (writing)
+    {
+        flush();
+        writing = false;
+    }
+    if (bufferPos == bufferEnd && !refill())
+        return nullptr;
+
+    size = bufferEnd - bufferPos;
+    const uint8_t* res = buffer + bufferPos;
+    bufferPos = bufferEnd;
+    return res;
+}
+
+size_t BufferedDataStream::pread(uint8_t* to, size_t size, size_t offset)
+{
+    flush();
+    return stream->pread(to, size, offset);
+}
+
+size_t BufferedDataStream::pwrite(uint8_t* from, size_t size, size_t offset)
+{
+    flush();
+    // read-ahead data of the range would be stale
+    if (!writing && offset < bufferBase + bufferEnd && offset + size > bufferBase)
+        discardReadBuffer();
+    return stream->pwrite(from, size, offset);
+}
+
+bool BufferedDataStream::seek(std::streamoff offset, bool fromCurrent)
+{
+    std::streamoff target = fromCurrent ? std::streamoff(tell()) + offset : offset;
+    if (target < 0)
+        return false;
+
+    if (!writing && size_t(target) >= bufferBase && size_t(target) <= bufferBase + bufferEnd)
+    {
+        bufferPos = size_t(target) - bufferBase;
+        return true;
+    }
+
+    if (!flush() || !stream->seek(target, false))
+        return false;
+    bufferBase = size_t(target);
+    bufferPos = bufferEnd = 0;
+    return true;
+}
+
+bool BufferedDataStream::eof()
+{
+    if (writing)
+        return tell() >= getSize();
+    return bufferPos >= bufferEnd && stream->eof();
+}
+
+size_t BufferedDataStream::getSize()
+{
+    size_t size = stream->getSize();
+    return writing ? std::max(size, tell()) : size;
+}
+
+void BufferedDataStream::close()
+{
+    flush();
+    bufferBase += bufferPos;
+    bufferPos = bufferEnd = 0;
+    stream->close();
+}
+
+std::shared_ptr<DataStream> BufferedDataStream::clone()
+{
+    DataStream::sptr copy = stream->clone();
+    if (!copy)
+        return nullptr;
+    return std::make_shared<BufferedDataStream>(copy, bufferSize, pool);
+}
+
+}}
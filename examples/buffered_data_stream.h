@@ -0,0 +1,122 @@
+#pragma once
+
+#include "filesystem/data_stream.h"
+#include <vector>
+#include <map>
+#include <mutex>
+#include <cstring>
+
+namespace sb { namespace filesystem {
+
+/// Aligned I/O buffers kept for reuse, safe to use from any thread
+class AlignedBufferPool : public sq::common::noncopyable
+{
+public:
+    using sptr = std::shared_ptr<AlignedBufferPool>;
+
+    /// alignment and size granularity of the buffers, enough for O_DIRECT
+    static const size_t ALIGNMENT = 4096;
+    /// released buffers above this many bytes are freed
+    static const size_t MAX_CACHED_BYTES = 16 * 1024 * 1024;
+
+    AlignedBufferPool() : cachedBytes(0) {}
+    ~AlignedBufferPool();
+
+    static sptr instance();
+
+    /// buffer of `size` bytes rounded up to ALIGNMENT, see roundSize()
+    uint8_t* acquire(size_t size);
+    /// `size` as passed to acquire()
+    void release(uint8_t* buffer, size_t size);
+    /// free all cached buffers
+    void trim();
+
+    static size_t roundSize(size_t size) { return (std::max<size_t>(size, 1) + ALIGNMENT - 1) & ~(ALIGNMENT - 1); }
+
+private:
+    std::mutex mutex;
+    std::map<size_t, std::vector<uint8_t*>> freeBuffers;
+    size_t cachedBytes;
+};
+
+/// Read and write buffering over any DataStream, like stdio: one buffer serves either direction.
+/// Reads and writes that fit the buffer are an inline memcpy, larger ones go to the stream directly.
+/// Written data reaches the stream on flush(), seek to outside the buffer, close() or destruction
+class BufferedDataStream : public DataStream
+{
+    SQ_DECLARE_OBJECT(BufferedDataStream)
+public:
+    using sptr = std::shared_ptr<BufferedDataStream>;
+
+    static const size_t DEFAULT_BUFFER_SIZE = 64 * 1024;
+
+    explicit BufferedDataStream(const DataStream::sptr& stream, size_t bufferSize = DEFAULT_BUFFER_SIZE,
+                                const AlignedBufferPool::sptr& pool = AlignedBufferPool::instance());
+    ~BufferedDataStream();
+
+    /// read `size` bytes to buffer, return realy readed bytes
+    virtual size_t read(uint8_t* buffer, size_t size) override final
+    {
+        if (!writing && size <= bufferEnd - bufferPos)
+        {
+            memcpy(buffer, this->buffer + bufferPos, size);
+            bufferPos += size;
+            return size;
+        }
+        return readSlow(buffer, size);
+    }
+    /// write `size` bytes from buffer, return realy writed bytes
+    virtual size_t write(uint8_t* buffer, size_t size) override final
+    {
+        if (writing && size <= bufferSize - bufferPos)
+        {
+            memcpy(this->buffer + bufferPos, buffer, size);
+            bufferPos += size;
+            return size;
+        }
+        return writeSlow(buffer, size);
+    }
+    /// bytes left in the buffer, refilled when empty
+    virtual const uint8_t* readDirect(size_t& size) override;
+    /// positional access goes to the stream, written data is flushed first
+    virtual size_t pread(uint8_t* buffer, size_t size, size_t offset) override;
+    virtual size_t pwrite(uint8_t* buffer, size_t size, size_t offset) override;
+    /// seek to absolute position if from_current==false else to relative from current;
+    /// inside the read buffer it doesn't reach the stream
+    virtual bool seek(std::streamoff offset, bool fromCurrent) override;
+    virtual bool eof() override;
+    virtual bool isValid() const override { return stream && stream->isValid(); }
+    virtual const std::string& path() const override { return stream->path(); }
+    /// flush and close the stream
+    virtual void close() override;
+    virtual size_t tell() override { return bufferBase + bufferPos; }
+    virtual size_t getSize() override;
+    /// buffered clone of the stream clone, nullptr if the stream can't be cloned
+    std::shared_ptr<DataStream> clone() override;
+
+    /// write the buffered data to the stream, false if it took less
+    bool flush();
+
+    const DataStream::sptr& getStream() const { return stream; }
+    size_t getBufferSize() const { return bufferSize; }
+
+private:
+    size_t readSlow(uint8_t* buffer, size_t size);
+    size_t writeSlow(const uint8_t* buffer, size_t size);
+    /// drop read-ahead data, the stream is moved back to the logical position
+    void discardReadBuffer();
+    bool refill();
+
+    DataStream::sptr stream;
+    AlignedBufferPool::sptr pool;
+    uint8_t* buffer;
+    size_t bufferSize;
+    // stream position of buffer[0]
+    size_t bufferBase;
+    size_t bufferPos;
+    // end of the read data, unused while writing
+    size_t bufferEnd;
+    bool writing;
+};
+
+}}
@@ -0,0 +1,116 @@
+#include "filesystem/data_stream.h"
+#include "filesystem/line_scanner.h"
+#include "filesystem/buffered_data_stream.h"
+
+namespace sb { namespace filesystem {
+
+size_t DataStream::readv(const IoBuffer *buffers, size_t count)
+{
+	size_t done = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		size_t readed = read(buffers[i].data, buffers[i].size);
+		done += readed;
+		if (readed < buffers[i].size)
+			break;
+	}
+	return done;
+}
+
+size_t DataStream::writev(const IoBuffer *buffers, size_t count)
+{
+	size_t done = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		size_t written = write(buffers[i].data, buffers[i].size);
+		done += written;
+		if (written < buffers[i].size)
+			break;
+	}
+	return done;
+}
+
+size_t DataStream::pread(unsigned char *buffer, size_t size, size_t offset)
+{
+	size_t pos = tell();
+	if (!seek(offset, false))
+		return 0;
+	size_t readed = read(buffer, size);
+	seek(pos, false);
+	return readed;
+}
+
+size_t DataStream::pwrite(unsigned char *buffer, size_t size, size_t offset)
+{
+	size_t pos = tell();
+	if (!seek(offset, false))
+		return 0;
+	size_t written = write(buffer, size);
+	seek(pos, false);
+	return written;
+}
+
+bool StreamLineReader::refill()
+{
+	size_t size = 0;
+	const unsigned char *direct = source->readDirect(size);
+	// nullptr at the end of a stream with views is no reason to buffer it
+	if (!direct && source == stream && !stream->eof())
+	{
+		// nothing consumed yet, the buffered wrapper continues from the same position
+		source = std::make_shared<BufferedDataStream>(stream, size_t(BUFFER_SIZE));
+		direct = source->readDirect(size);
+	}
+
+	chunk = direct;
+	chunkSize = direct ? size : 0;
+	chunkPos = 0;
+	return chunkSize != 0;
+}
+
+LineView StreamLineReader::makeLine(const unsigned char *begin, const unsigned char *end)
+{
+	if (end != begin && end[-1] == '\r')
+		--end;
+	return LineView(reinterpret_cast<const char*>(begin), end - begin);
+}
+
+LineView StreamLineReader::nextLine()
+{
+	line.clear();
+	while (chunkPos < chunkSize || refill())
+	{
+		const unsigned char *begin = chunk + chunkPos;
+		const unsigned char *end = chunk + chunkSize;
+		const unsigned char *newline = findNewline(begin, end);
+		if (!newline)
+		{
+			// the block is replaced by the next refill, keep its tail
+			line.insert(line.end(), begin, end);
+			chunkPos = chunkSize;
+			continue;
+		}
+
+		chunkPos = newline + 1 - chunk;
+		if (line.empty())
+			return makeLine(begin, newline);
+		line.insert(line.end(), begin, newline);
+		break;
+	}
+
+	// the last line may have no terminator
+	return makeLine(line.data(), line.data() + line.size());
+}
+
+void StreamLineReader::getLine(std::string& to)
+{
+	LineView view = nextLine();
+	to.assign(view.data(), view.size());
+}
+
+bool StreamLineReader::eof()
+{
+	return chunkPos >= chunkSize && source->eof();
+}
+
+}}
@@ -2,6 +2,9 @@
 
 #include "common.h"
 #include "scripting/TypeInfo.h"
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 
 namespace sb { namespace filesystem {
 
@@ -13,6 +16,13 @@ enum class FileMode
     APPEND
 };
 
+/// one buffer of a vectored read or write
+struct IoBuffer
+{
+	unsigned char *data;
+	size_t size;
+};
+
 class DataStream : public sq::common::noncopyable
 {
 	SQ_DECLARE_BASE_OBJECT(DataStream)
@@ -22,6 +32,15 @@ public:
 	virtual size_t read(unsigned char *buffer, size_t size) = 0;
 	/// write `size` bytes from buffer, return realy writed bytes
 	virtual size_t write(unsigned char *buffer, size_t size) = 0;
+	/// read into `count` buffers in turn, return realy readed bytes; stops at the first short read
+	virtual size_t readv(const IoBuffer *buffers, size_t count);
+	/// write `count` buffers in turn, return realy writed bytes
+	virtual size_t writev(const IoBuffer *buffers, size_t count);
+	/// read at absolute `offset` leaving the position unchanged. The default seeks there and back,
+	/// streams overriding it allow concurrent calls
+	virtual size_t pread(unsigned char *buffer, size_t size, size_t offset);
+	/// write at absolute `offset` leaving the position unchanged, see pread
+	virtual size_t pwrite(unsigned char *buffer, size_t size, size_t offset);
 	/// seek to absolute position if from_current==false else to relative from current
 	virtual bool seek(std::streamoff offset, bool fromCurrent) = 0;
 	/// eof indicator
@@ -36,18 +55,52 @@ public:
 	virtual size_t getSize() { return 0; }
 	/// clone stream ( open some file )
 	virtual std::shared_ptr<DataStream> clone() { return std::shared_ptr<DataStream>(); }
+	/// zero-copy read of the bytes following the current position, as many as are contiguous in memory,
+	/// and advance past them. nullptr if not supported; the bytes stay valid until the stream is used again
+	virtual const unsigned char* readDirect(size_t &size) { size = 0; return nullptr; }
 
     using sptr = std::shared_ptr<DataStream>;
 };
 
+/// Bytes of one line without its terminator, not owned
+class LineView
+{
+public:
+	LineView() : ptr(nullptr), len(0) {}
+	LineView(const char *data, size_t size) : ptr(data), len(size) {}
+
+	const char* data() const { return ptr; }
+	size_t size() const { return len; }
+	bool empty() const { return len == 0; }
+	const char* begin() const { return ptr; }
+	const char* end() const { return ptr + len; }
+	char operator[](size_t index) const { return ptr[index]; }
+	std::string str() const { return std::string(ptr, len); }
+#if __cplusplus >= 201703L
+	operator std::string_view() const { return std::string_view(ptr, len); }
+#endif
+
+private:
+	const char *ptr;
+	size_t len;
+};
+
+/// Splits a stream by '\n', a "\r\n" terminator is removed as a whole.
+/// Lines are taken straight from memory of streams supporting DataStream::readDirect,
+/// only a line crossing the end of such a block is copied. Other streams are read
+/// through a BufferedDataStream
 class StreamLineReader : public sq::common::noncopyable
 {
 public:
 	explicit StreamLineReader(const DataStream::sptr &stream)
-		:stream(stream), bufferPos(0) {}
+		:stream(stream), source(stream), chunk(nullptr), chunkPos(0), chunkSize(0) {}
 	/// read line from stream
 	void getLine(std::string& to);
+	/// next line, valid until the following call or any use of the stream; empty at the end
+	LineView nextLine();
 	bool eof();
+	/// stream position of the next line
+	size_t tell() { return source->tell() - (chunkSize - chunkPos); }
 
 	const DataStream::sptr &getStream() const { return stream; }
 
@@ -55,13 +108,22 @@ public:
 	{
 		return std::make_shared<StreamLineReader>(stream);
 	}
-public:
 private:
+	/// get the next block of the stream, false at the end
+	bool refill();
+	static LineView makeLine(const unsigned char *begin, const unsigned char *end);
+
 	DataStream::sptr stream;
+	/// the stream, or its buffered wrapper when it doesn't support readDirect
+	DataStream::sptr source;
 	typedef std::vector<unsigned char> bufferType;
-	bufferType buffer;
-	size_t bufferPos;
-	static const size_t BUFFER_SIZE = 1024 * 4;
+	/// a line split between blocks
+	bufferType line;
+	/// current block of the source
+	const unsigned char *chunk;
+	size_t chunkPos;
+	size_t chunkSize;
+	static const size_t BUFFER_SIZE = 1024 * 64;
 };
 
 }}
@@ -0,0 +1,995 @@
+#ifndef _MSC_VER
+
+#include "filesystem/io_uring_data_stream.h"
+#include "common/ThreadPool.h"
+
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define SB_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+namespace sb { namespace filesystem {
+
+struct IoUringDataStream::request
+{
+    bool write;
+    bool async;
+    // index of a registered bounce buffer, -1 - plain vectored request
+    int fixedIndex;
+    // nullptr - the request transfers `single`
+    const iovec* iov;
+    unsigned iovCount;
+    iovec single;
+    uint64_t offset;
+    long result;
+    bool done;
+    completion callback;
+
+    request() : write(false), async(false), fixedIndex(-1), iov(nullptr), iovCount(1), offset(0), result(0), done(false)
+    {
+        single.iov_base = nullptr;
+        single.iov_len = 0;
+    }
+
+    const iovec* vectors() const { return iov ? iov : &single; }
+
+    size_t bytes() const
+    {
+        size_t res = 0;
+        for (unsigned i = 0; i < iovCount; ++i)
+            res += vectors()[i].iov_len;
+        return res;
+    }
+};
+
+/// completion pool job of an async request, `transfer` - it does the pread/pwrite too.
+/// A job the pool drops unrun on stop still finishes the request, so wait() and close() don't hang;
+/// a transfer that never happened reports -ECANCELED
+struct IoUringDataStream::completionJob
+{
+    IoUringDataStream* stream;
+    request* req;
+    bool transfer;
+
+    completionJob(IoUringDataStream* streamParam, request* reqParam, bool transferParam) :
+        stream(streamParam), req(reqParam), transfer(transferParam) {}
+    completionJob(completionJob&& other) :
+        stream(other.stream), req(other.req), transfer(other.transfer)
+    {
+        other.req = nullptr;
+    }
+    completionJob(const completionJob&) = delete;
+    ~completionJob()
+    {
+        if (!req)
+            return;
+        if (transfer)
+            req->result = -ECANCELED;
+        stream->finishAsync(release());
+    }
+
+    void operator()()
+    {
+        request* taken = release();
+        if (transfer)
+            taken->result = stream->runFallback(taken);
+        stream->finishAsync(taken);
+    }
+
+    /// the pool refused the job, the caller finishes the request
+    request* release()
+    {
+        request* res = req;
+        req = nullptr;
+        return res;
+    }
+};
+
+#ifdef SB_HAVE_IO_URING
+
+struct IoUringDataStream::ringState
+{
+    int fd;
+    unsigned entries;
+    // requests in the ring at once, so completions never overflow
+    unsigned cqEntries;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    io_uring_sqe* sqes;
+    size_t sqesSize;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    io_uring_cqe* cqes;
+};
+
+namespace {
+
+/// io_uring_enter retried on interruption, returns -errno on failure
+int ringEnter(int ringFd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    for (;;)
+    {
+        int res = static_cast<int>(syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0));
+        if (res >= 0)
+            return res;
+        if (errno != EINTR)
+            return -errno;
+    }
+}
+
+}
+
+bool IoUringDataStream::setupRing()
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ringFd = static_cast<int>(syscall(__NR_io_uring_setup, opts.queueDepth, &params));
+    if (ringFd < 0)
+        return false;
+#ifdef IORING_FEAT_NODROP
+    bool noDrop = (params.features & IORING_FEAT_NODROP) != 0;
+#else
+    bool noDrop = false;
+#endif
+    // older kernels drop completions past a full queue, their requests would never finish
+    if (!noDrop)
+    {
+        ::close(ringFd);
+        return false;
+    }
+
+    ringState* r = new ringState();
+    r->fd = ringFd;
+    r->entries = params.sq_entries;
+    r->cqEntries = params.cq_entries;
+    r->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    // both rings share one mapping on kernels >= 5.4
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single)
+        r->sqRingSize = r->cqRingSize = std::max(r->sqRingSize, r->cqRingSize);
+    r->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+    r->sqRing = mmap(nullptr, r->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    r->cqRing = single ? r->sqRing
+                       : mmap(nullptr, r->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    void* sqes = mmap(nullptr, r->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (r->sqRing == MAP_FAILED || r->cqRing == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, r->sqesSize);
+        if (!single && r->cqRing != MAP_FAILED)
+            munmap(r->cqRing, r->cqRingSize);
+        if (r->sqRing != MAP_FAILED)
+            munmap(r->sqRing, r->sqRingSize);
+        ::close(ringFd);
+        delete r;
+        return false;
+    }
+
+    uint8_t* sq = static_cast<uint8_t*>(r->sqRing);
+    uint8_t* cq = static_cast<uint8_t*>(r->cqRing);
+    r->sqes = static_cast<io_uring_sqe*>(sqes);
+    r->sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    r->sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    r->sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    r->sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    r->cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    r->cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    r->cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    r->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    ring = r;
+    return true;
+}
+
+void IoUringDataStream::destroyRing()
+{
+    if (!ring)
+        return;
+    munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+    munmap(ring->sqRing, ring->sqRingSize);
+    ::close(ring->fd);
+    delete ring;
+    ring = nullptr;
+}
+
+bool IoUringDataStream::pushRequest(request* req)
+{
+    unsigned tail = *ring->sqTail;
+    unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    if (tail - head >= ring->entries || inRing >= ring->cqEntries)
+        return false;
+
+    unsigned index = tail & *ring->sqMask;
+    io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    if (!req)
+    {
+        // wakes the reaper
+        sqe->opcode = IORING_OP_NOP;
+    }
+    else if (req->fixedIndex >= 0)
+    {
+        sqe->opcode = req->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uintptr_t>(req->single.iov_base);
+        sqe->len = static_cast<unsigned>(req->single.iov_len);
+        sqe->buf_index = static_cast<uint16_t>(req->fixedIndex);
+    }
+    else
+    {
+        sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uintptr_t>(req->vectors());
+        sqe->len = req->iovCount;
+    }
+    if (req)
+        sqe->off = req->offset;
+    sqe->user_data = reinterpret_cast<uintptr_t>(req);
+
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++unsubmitted;
+    ++inRing;
+    return true;
+}
+
+void IoUringDataStream::reapLocked(std::vector<request*>& finished)
+{
+    unsigned head = *ring->cqHead;
+    unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head)
+    {
+        io_uring_cqe* cqe = &ring->cqes[head & *ring->cqMask];
+        request* req = reinterpret_cast<request*>(static_cast<uintptr_t>(cqe->user_data));
+        --inRing;
+        if (!req)
+            continue;
+        req->result = cqe->res;
+        req->done = true;
+        if (req->async)
+            finished.push_back(req);
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+void IoUringDataStream::reaperLoop()
+{
+    while (!stopping.load(std::memory_order_acquire))
+    {
+        // waits without the lock, synchronous callers keep using the ring meanwhile
+        ringEnter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+        poll();
+    }
+    stopping.store(false, std::memory_order_release);
+}
+
+int IoUringDataStream::enterLocked(unsigned minComplete, bool getEvents)
+{
+    int res = ringEnter(ring->fd, unsubmitted, minComplete, getEvents ? IORING_ENTER_GETEVENTS : 0);
+    if (res > 0)
+        unsubmitted -= std::min<unsigned>(unsubmitted, static_cast<unsigned>(res));
+    // a full completion queue or lack of memory only delays the submission
+    if (res < 0 && res != -EAGAIN && res != -EBUSY)
+        throw std::runtime_error("io_uring_enter failed: " + std::string(strerror(-res)));
+    return res;
+}
+
+#else
+
+struct IoUringDataStream::ringState
+{
+    int fd;
+};
+
+bool IoUringDataStream::setupRing()
+{
+    return false;
+}
+
+void IoUringDataStream::destroyRing()
+{
+}
+
+bool IoUringDataStream::pushRequest(request*)
+{
+    return false;
+}
+
+int IoUringDataStream::enterLocked(unsigned, bool)
+{
+    return -ENOSYS;
+}
+
+void IoUringDataStream::reapLocked(std::vector<request*>&)
+{
+}
+
+void IoUringDataStream::reaperLoop()
+{
+}
+
+#endif
+
+void IoUringDataStream::pushLocked(request* req, std::vector<request*>& finished)
+{
+    while (!pushRequest(req))
+    {
+        // a full ring holds requests the kernel is working on or ones to submit
+        bool inKernel = inRing > unsubmitted;
+        enterLocked(inKernel ? 1 : 0, inKernel);
+        reapLocked(finished);
+    }
+}
+
+void IoUringDataStream::submitLocked(std::vector<request*>& finished)
+{
+    while (unsubmitted)
+    {
+        // completions waiting to be taken may block submission
+        if (enterLocked(0, false) <= 0)
+            reapLocked(finished);
+    }
+}
+
+void IoUringDataStream::runBatch(request* requests, size_t count)
+{
+    if (!ring)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            requests[i].result = runFallback(&requests[i]);
+            requests[i].done = true;
+        }
+        return;
+    }
+
+    std::vector<request*> finished;
+    {
+        std::lock_guard<std::mutex> lock(ringMutex);
+        size_t pushed = 0;
+        for (;;)
+        {
+            while (pushed < count && pushRequest(&requests[pushed]))
+                ++pushed;
+
+            size_t pending = count - pushed;
+            for (size_t i = 0; i < pushed; ++i)
+                pending += requests[i].done ? 0 : 1;
+            if (!pending)
+                break;
+
+            // submits async requests of other callers queued meanwhile too
+            enterLocked(1, true);
+            reapLocked(finished);
+        }
+    }
+    dispatch(finished);
+}
+
+size_t IoUringDataStream::submit()
+{
+    if (ring)
+    {
+        std::vector<request*> finished;
+        size_t res;
+        {
+            std::lock_guard<std::mutex> lock(ringMutex);
+            res = unsubmitted;
+            submitLocked(finished);
+        }
+        dispatch(finished);
+        return res;
+    }
+
+    std::vector<request*> taken;
+    {
+        std::lock_guard<std::mutex> lock(ringMutex);
+        taken.swap(queued);
+    }
+    for (request* req : taken)
+    {
+        if (completionPool)
+        {
+            completionJob job(this, req, true);
+            if (completionPool->submit(std::move(job)).valid())
+                continue;
+            job.release();
+        }
+        req->result = runFallback(req);
+        std::lock_guard<std::mutex> lock(ringMutex);
+        completed.push_back(req);
+    }
+    return taken.size();
+}
+
+void IoUringDataStream::queueAsync(request* req)
+{
+    inFlight.fetch_add(1, std::memory_order_relaxed);
+    std::vector<request*> finished;
+    {
+        std::lock_guard<std::mutex> lock(ringMutex);
+        if (!ring)
+        {
+            queued.push_back(req);
+            return;
+        }
+        pushLocked(req, finished);
+    }
+    dispatch(finished);
+}
+
+size_t IoUringDataStream::poll()
+{
+    std::vector<request*> finished;
+    {
+        std::lock_guard<std::mutex> lock(ringMutex);
+        if (ring)
+            reapLocked(finished);
+        else
+            finished.swap(completed);
+    }
+    dispatch(finished);
+    return finished.size();
+}
+
+void IoUringDataStream::wait()
+{
+    submit();
+    if (completionPool)
+    {
+        std::unique_lock<std::mutex> lock(idleMutex);
+        idle.wait(lock, [this]() { return inFlight.load(std::memory_order_acquire) == 0; });
+        return;
+    }
+
+    while (inFlight.load(std::memory_order_acquire))
+    {
+        if (ring)
+        {
+            std::unique_lock<std::mutex> lock(ringMutex);
+            if (inRing)
+            {
+                enterLocked(1, true);
+            }
+            else
+            {
+                // reaped by a synchronous call, which runs the callbacks
+                lock.unlock();
+                std::this_thread::yield();
+            }
+        }
+        poll();
+    }
+}
+
+void IoUringDataStream::stopReaper()
+{
+    if (!reaper.joinable())
+        return;
+    stopping.store(true, std::memory_order_release);
+    // no-op completions wake the reaper; repeated as poll() of another thread may take one first
+    while (stopping.load(std::memory_order_acquire))
+    {
+        std::vector<request*> finished;
+        {
+            std::lock_guard<std::mutex> lock(ringMutex);
+            pushLocked(nullptr, finished);
+            submitLocked(finished);
+        }
+        dispatch(finished);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    reaper.join();
+}
+
+namespace {
+
+/// copy `size` bytes starting `position` bytes into the buffers to `to`
+void gatherBuffers(const IoBuffer* buffers, size_t count, size_t position, uint8_t* to, size_t size)
+{
+    for (size_t i = 0; i < count && size; ++i)
+    {
+        if (position >= buffers[i].size)
+        {
+            position -= buffers[i].size;
+            continue;
+        }
+        size_t chunk = std::min(buffers[i].size - position, size);
+        memcpy(to, buffers[i].data + position, chunk);
+        to += chunk;
+        size -= chunk;
+        position = 0;
+    }
+}
+
+/// copy `size` bytes from `from` to the buffers starting `position` bytes into them
+void scatterBuffers(const IoBuffer* buffers, size_t count, size_t position, const uint8_t* from, size_t size)
+{
+    for (size_t i = 0; i < count && size; ++i)
+    {
+        if (position >= buffers[i].size)
+        {
+            position -= buffers[i].size;
+            continue;
+        }
+        size_t chunk = std::min(buffers[i].size - position, size);
+        memcpy(buffers[i].data + position, from, chunk);
+        from += chunk;
+        size -= chunk;
+        position = 0;
+    }
+}
+
+}
+
+IoUringDataStream::IoUringDataStream(const std::string& filenameParam, FileMode accessModeParam, const options& optsParam) :
+    filename(filenameParam),
+    accessMode(accessModeParam),
+    opts(optsParam),
+    fd(-1),
+    filesize(0),
+    curPos(0),
+    ring(nullptr),
+    buffers(nullptr),
+    buffersRegistered(false),
+    unsubmitted(0),
+    inRing(0),
+    completionPool(nullptr),
+    stopping(false),
+    inFlight(0)
+{
+    int flags = O_CLOEXEC;
+    switch (accessMode)
+    {
+        case FileMode::READ:
+            flags |= O_RDONLY;
+            break;
+        case FileMode::WRITE:
+        case FileMode::READ_WRITE:
+        case FileMode::APPEND:
+            // read access for the read-modify-write of partial direct blocks
+            flags |= O_RDWR | O_CREAT;
+            break;
+    }
+#ifdef O_DIRECT
+    if (opts.direct)
+        flags |= O_DIRECT;
+#endif
+
+    fd = ::open(filename.c_str(), flags, (mode_t) 0600);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0)
+        filesize = static_cast<size_t>(st.st_size);
+    if (accessMode == FileMode::APPEND)
+        curPos = filesize.load();
+
+    if (!opts.disableIoUring)
+        setupRing();
+    if (opts.direct)
+        allocateBuffers();
+}
+
+IoUringDataStream::~IoUringDataStream()
+{
+    close();
+}
+
+void IoUringDataStream::allocateBuffers()
+{
+    if (!opts.bufferCount)
+        opts.bufferCount = 1;
+    // every bounce buffer starts and ends on a direct I/O block
+    opts.bufferSize = (std::max<size_t>(opts.bufferSize, 1) + DIRECT_ALIGNMENT - 1) & ~(DIRECT_ALIGNMENT - 1);
+    void* memory = nullptr;
+    if (posix_memalign(&memory, DIRECT_ALIGNMENT, opts.bufferSize * opts.bufferCount))
+        throw std::bad_alloc();
+    buffers = static_cast<uint8_t*>(memory);
+
+#ifdef SB_HAVE_IO_URING
+    if (ring)
+    {
+        // registered buffers skip the page pinning of every request; fails past RLIMIT_MEMLOCK
+        std::vector<iovec> iov(opts.bufferCount);
+        for (size_t i = 0; i < opts.bufferCount; ++i)
+        {
+            iov[i].iov_base = buffers + i * opts.bufferSize;
+            iov[i].iov_len = opts.bufferSize;
+        }
+        buffersRegistered = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+                                    iov.data(), static_cast<unsigned>(iov.size())) == 0;
+    }
+#endif
+}
+
+long IoUringDataStream::runFallback(request* req)
+{
+    for (;;)
+    {
+        ssize_t res;
+        const iovec* iov = req->vectors();
+        if (req->iovCount == 1)
+        {
+            res = req->write ? ::pwrite(fd, iov->iov_base, iov->iov_len, req->offset)
+                             : ::pread(fd, iov->iov_base, iov->iov_len, req->offset);
+        }
+        else
+        {
+            res = req->write ? ::pwritev(fd, iov, static_cast<int>(req->iovCount), req->offset)
+                             : ::preadv(fd, iov, static_cast<int>(req->iovCount), req->offset);
+        }
+        if (res >= 0)
+            return static_cast<long>(res);
+        if (errno != EINTR)
+            return -errno;
+    }
+}
+
+size_t IoUringDataStream::transfer(bool write, const IoBuffer* ioBuffers, size_t count, uint64_t offset)
+{
+    if (fd < 0)
+        return 0;
+    if (opts.direct)
+        return transferDirect(write, ioBuffers, count, offset);
+
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i)
+        total += ioBuffers[i].size;
+
+    size_t done = 0;
+    while (done < total)
+    {
+        // iovecs of the part not transferred yet
+        std::vector<iovec> iov;
+        size_t skip = done;
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (skip >= ioBuffers[i].size)
+            {
+                skip -= ioBuffers[i].size;
+                continue;
+            }
+            iovec entry;
+            entry.iov_base = ioBuffers[i].data + skip;
+            entry.iov_len = ioBuffers[i].size - skip;
+            iov.push_back(entry);
+            skip = 0;
+        }
+
+        // one request per IOV_MAX iovecs, all of them in one batch
+        std::vector<request> requests((iov.size() + IOV_MAX - 1) / IOV_MAX);
+        uint64_t position = offset + done;
+        for (size_t i = 0; i < requests.size(); ++i)
+        {
+            request& req = requests[i];
+            req.write = write;
+            req.iov = iov.data() + i * IOV_MAX;
+            req.iovCount = static_cast<unsigned>(std::min<size_t>(IOV_MAX, iov.size() - i * IOV_MAX));
+            req.offset = position;
+            position += req.bytes();
+        }
+        runBatch(requests.data(), requests.size());
+
+        // only the contiguous prefix counts, a short request is retried from its end
+        bool progress = false;
+        bool shortRequest = false;
+        for (auto& req : requests)
+        {
+            if (req.result <= 0)
+                break;
+            done += static_cast<size_t>(req.result);
+            progress = true;
+            if (static_cast<size_t>(req.result) < req.bytes())
+            {
+                shortRequest = true;
+                break;
+            }
+        }
+        if (!progress || (!shortRequest && done < total))
+            break;
+    }
+    return done;
+}
+
+size_t IoUringDataStream::transferDirect(bool write, const IoBuffer* ioBuffers, size_t count, uint64_t offset)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i)
+        total += ioBuffers[i].size;
+    if (!total)
+        return 0;
+
+    std::lock_guard<std::mutex> lock(bufferMutex);
+    const uint64_t end = offset + total;
+    const uint64_t alignedEnd = (end + DIRECT_ALIGNMENT - 1) & ~uint64_t(DIRECT_ALIGNMENT - 1);
+    uint64_t position = offset & ~uint64_t(DIRECT_ALIGNMENT - 1);
+    size_t done = 0;
+
+    std::vector<request> requests(opts.bufferCount);
+    while (position < alignedEnd)
+    {
+        size_t batch = 0;
+        for (; batch < opts.bufferCount && position < alignedEnd; ++batch)
+        {
+            request& req = requests[batch];
+            req = request();
+            req.write = false;
+            req.fixedIndex = buffersRegistered ? static_cast<int>(batch) : -1;
+            req.single.iov_base = buffers + batch * opts.bufferSize;
+            req.single.iov_len = static_cast<size_t>(std::min<uint64_t>(opts.bufferSize, alignedEnd - position));
+            req.offset = position;
+            position += req.single.iov_len;
+        }
+
+        if (write)
+        {
+            // blocks only partly covered by the data keep the bytes around it
+            std::vector<request> edges;
+            for (size_t i = 0; i < batch; ++i)
+            {
+                request& req = requests[i];
+                bool partial = req.offset < offset || req.offset + req.single.iov_len > end;
+                if (partial && req.offset < filesize.load())
+                    edges.push_back(req);
+            }
+            runBatch(edges.data(), edges.size());
+
+            for (size_t i = 0; i < batch; ++i)
+            {
+                request& req = requests[i];
+                uint8_t* chunk = static_cast<uint8_t*>(req.single.iov_base);
+                size_t valid = 0;
+                for (auto& edge : edges)
+                    if (edge.offset == req.offset)
+                        valid = edge.result > 0 ? static_cast<size_t>(edge.result) : 0;
+                // beyond the end of file
+                memset(chunk + valid, 0, req.single.iov_len - valid);
+
+                uint64_t from = std::max<uint64_t>(req.offset, offset);
+                uint64_t to = std::min<uint64_t>(req.offset + req.single.iov_len, end);
+                gatherBuffers(ioBuffers, count, static_cast<size_t>(from - offset), chunk + (from - req.offset),
+                              static_cast<size_t>(to - from));
+                req.write = true;
+                req.done = false;
+            }
+        }
+
+        runBatch(requests.data(), batch);
+
+        for (size_t i = 0; i < batch; ++i)
+        {
+            request& req = requests[i];
+            uint64_t valid = req.result > 0 ? static_cast<uint64_t>(req.result) : 0;
+            uint64_t from = std::max<uint64_t>(req.offset, offset);
+            uint64_t to = std::min<uint64_t>(req.offset + valid, end);
+            if (to > from)
+            {
+                if (!write)
+                    scatterBuffers(ioBuffers, count, static_cast<size_t>(from - offset),
+                                   static_cast<uint8_t*>(req.single.iov_base) + (from - req.offset),
+                                   static_cast<size_t>(to - from));
+                done += static_cast<size_t>(to - from);
+            }
+            // end of file or an error, later chunks don't continue the data
+            if (valid < req.single.iov_len)
+                return done;
+        }
+    }
+    return done;
+}
+
+size_t IoUringDataStream::read(uint8_t* buffer, size_t size)
+{
+    size_t done = pread(buffer, size, curPos);
+    curPos += done;
+    return done;
+}
+
+size_t IoUringDataStream::write(uint8_t* buffer, size_t size)
+{
+    size_t done = pwrite(buffer, size, curPos);
+    curPos += done;
+    return done;
+}
+
+size_t IoUringDataStream::readv(const IoBuffer* ioBuffers, size_t count)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i)
+        total += ioBuffers[i].size;
+    size_t end = filesize.load();
+    size_t amount = curPos < end ? std::min(total, end - curPos) : 0;
+
+    // the tail of the buffers past the end of file is not requested
+    std::vector<IoBuffer> clamped;
+    for (size_t i = 0; i < count && amount; ++i)
+    {
+        IoBuffer part = { ioBuffers[i].data, std::min(ioBuffers[i].size, amount) };
+        clamped.push_back(part);
+        amount -= part.size;
+    }
+    size_t done = transfer(false, clamped.data(), clamped.size(), curPos);
+    curPos += done;
+    return done;
+}
+
+size_t IoUringDataStream::writev(const IoBuffer* ioBuffers, size_t count)
+{
+    if (accessMode == FileMode::READ)
+        return 0;
+    size_t done = transfer(true, ioBuffers, count, curPos);
+    curPos += done;
+    extendSize(curPos);
+    return done;
+}
+
+size_t IoUringDataStream::pread(uint8_t* buffer, size_t size, size_t offset)
+{
+    // direct reads of the last block may see the padding of a file not trimmed yet
+    size_t end = filesize.load();
+    if (offset >= end)
+        return 0;
+    IoBuffer io = { buffer, std::min(size, end - offset) };
+    return transfer(false, &io, 1, offset);
+}
+
+size_t IoUringDataStream::pwrite(uint8_t* buffer, size_t size, size_t offset)
+{
+    if (accessMode == FileMode::READ)
+        return 0;
+    IoBuffer io = { buffer, size };
+    size_t done = transfer(true, &io, 1, offset);
+    extendSize(offset + done);
+    return done;
+}
+
+bool IoUringDataStream::seek(std::streamoff offset, bool fromCurrent)
+{
+    std::streamoff target = fromCurrent ? std::streamoff(curPos) + offset : offset;
+    if (target < 0 || (accessMode == FileMode::READ && size_t(target) > filesize.load()))
+        return false;
+    curPos = size_t(target);
+    return true;
+}
+
+void IoUringDataStream::readAsync(uint8_t* buffer, size_t size, size_t offset, completion done)
+{
+    request* req = new request();
+    req->async = true;
+    req->single.iov_base = buffer;
+    req->single.iov_len = size;
+    req->offset = offset;
+    req->callback = std::move(done);
+    queueAsync(req);
+}
+
+void IoUringDataStream::writeAsync(const uint8_t* buffer, size_t size, size_t offset, completion done)
+{
+    request* req = new request();
+    req->write = true;
+    req->async = true;
+    req->single.iov_base = const_cast<uint8_t*>(buffer);
+    req->single.iov_len = size;
+    req->offset = offset;
+    req->callback = std::move(done);
+    queueAsync(req);
+}
+
+void IoUringDataStream::dispatch(std::vector<request*>& finished)
+{
+    for (size_t i = 0; i < finished.size(); ++i)
+    {
+        request* req = finished[i];
+        if (completionPool)
+        {
+            completionJob job(this, req, false);
+            if (completionPool->submit(std::move(job)).valid())
+                continue;
+            job.release();
+        }
+        finishAsync(req);
+    }
+}
+
+void IoUringDataStream::finishAsync(request* req)
+{
+    // the request is counted out even when the callback throws
+    struct finisher
+    {
+        IoUringDataStream* stream;
+        request* req;
+        ~finisher()
+        {
+            delete req;
+            std::lock_guard<std::mutex> lock(stream->idleMutex);
+            if (stream->inFlight.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                stream->idle.notify_all();
+        }
+    } guard = { this, req };
+
+    // only what reached the file counts, the callback sees the new size
+    if (req->write && req->result > 0)
+        extendSize(static_cast<size_t>(req->offset) + static_cast<size_t>(req->result));
+    if (req->callback)
+        req->callback(req->result);
+}
+
+void IoUringDataStream::extendSize(size_t end)
+{
+    size_t current = filesize.load();
+    while (end > current && !filesize.compare_exchange_weak(current, end))
+    {
+    }
+}
+
+void IoUringDataStream::setCompletionPool(common::ThreadPool* pool)
+{
+    stopReaper();
+    completionPool = pool;
+    if (pool && ring)
+        reaper = std::thread([this]() { reaperLoop(); });
+}
+
+void IoUringDataStream::close()
+{
+    if (fd < 0)
+        return;
+
+    wait();
+    stopReaper();
+    // direct writes leave the last block padded
+    size_t end = filesize.load();
+    if (opts.direct && accessMode != FileMode::READ && end % DIRECT_ALIGNMENT)
+    {
+        if (ftruncate(fd, static_cast<off_t>(end)))
+        {
+            // the padding stays, the data is intact
+        }
+    }
+    ::close(fd);
+    fd = -1;
+    destroyRing();
+    free(buffers);
+    buffers = nullptr;
+    buffersRegistered = false;
+    completionPool = nullptr;
+}
+
+std::shared_ptr<DataStream> IoUringDataStream::clone()
+{
+    return std::make_shared<IoUringDataStream>(filename, accessMode, opts);
+}
+
+}}
+
+#endif
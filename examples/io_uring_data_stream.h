@@ -0,0 +1,171 @@
+#pragma once
+
+#include "filesystem/data_stream.h"
+#include <functional>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+
+namespace sb { namespace common {
+class ThreadPool;
+}}
+
+namespace sb { namespace filesystem {
+
+/// File stream doing plain reads and writes through io_uring, for workloads where mapping
+/// the file doesn't pay off: huge sequential writes, files on filesystems with expensive faults.
+/// A synchronous call submits its pieces as one batch and waits for them, asynchronous requests
+/// are queued until submit(). Falls back to pread/pwrite when io_uring is unavailable
+/// (kernel before 5.5, seccomp, non-Linux). POSIX only
+class IoUringDataStream : public DataStream
+{
+    SQ_DECLARE_OBJECT(IoUringDataStream)
+public:
+    using sptr = std::shared_ptr<IoUringDataStream>;
+    /// bytes transferred or -errno
+    using completion = std::function<void(long result)>;
+
+    static const unsigned DEFAULT_QUEUE_DEPTH = 64;
+    static const size_t DEFAULT_BUFFER_SIZE = 1024 * 1024;
+    static const size_t DEFAULT_BUFFER_COUNT = 8;
+    /// alignment of file offsets, sizes and memory with O_DIRECT
+    static const size_t DIRECT_ALIGNMENT = 4096;
+
+    struct options
+    {
+        /// open with O_DIRECT; synchronous calls go through aligned bounce buffers,
+        /// asynchronous ones need DIRECT_ALIGNMENT aligned arguments
+        bool     direct;
+        /// submission queue entries
+        unsigned queueDepth;
+        /// bounce buffers of direct I/O, registered with the ring
+        size_t   bufferSize;
+        size_t   bufferCount;
+        /// use pread/pwrite even when io_uring works
+        bool     disableIoUring;
+
+        options()
+            : direct(false), queueDepth(DEFAULT_QUEUE_DEPTH), bufferSize(DEFAULT_BUFFER_SIZE),
+              bufferCount(DEFAULT_BUFFER_COUNT), disableIoUring(false) {}
+    };
+
+    /// WRITE, READ_WRITE and APPEND create the file, APPEND starts at its end
+    IoUringDataStream(const std::string& filename, FileMode accessMode, const options& opts = options());
+    ~IoUringDataStream();
+
+    /// read `size` bytes to buffer, return realy readed bytes
+    virtual size_t read(uint8_t* buffer, size_t size) override;
+    /// write `size` bytes from buffer, return realy writed bytes
+    virtual size_t write(uint8_t* buffer, size_t size) override;
+    /// all buffers in one submission
+    virtual size_t readv(const IoBuffer* buffers, size_t count) override;
+    virtual size_t writev(const IoBuffer* buffers, size_t count) override;
+    /// positional access, concurrent calls are serialized on the ring
+    virtual size_t pread(uint8_t* buffer, size_t size, size_t offset) override;
+    virtual size_t pwrite(uint8_t* buffer, size_t size, size_t offset) override;
+    /// seek to absolute position if from_current==false else to relative from current;
+    /// writable streams may seek past the end
+    virtual bool seek(std::streamoff offset, bool fromCurrent) override;
+    virtual bool eof() override { return curPos >= filesize.load(); }
+    virtual bool isValid() const override { return fd >= 0; }
+    virtual const std::string& path() const override { return filename; }
+    /// waits for asynchronous requests
+    virtual void close() override;
+    virtual size_t tell() override { return curPos; }
+    virtual size_t getSize() override { return filesize.load(); }
+    /// the same file opened again with the same options
+    std::shared_ptr<DataStream> clone() override;
+
+    /// queue a read of [offset, offset + size) into `buffer`, started by submit().
+    /// `done` runs on the completion pool when set, else on the thread that takes the completion:
+    /// inside poll(), wait() or a call waiting for room in the ring. The buffer must stay valid until then
+    void readAsync(uint8_t* buffer, size_t size, size_t offset, completion done);
+    /// the size grows by the bytes written once the request completes
+    void writeAsync(const uint8_t* buffer, size_t size, size_t offset, completion done);
+    /// start the queued requests with one system call, returns their count
+    size_t submit();
+    /// run completions that have arrived, returns their count
+    size_t poll();
+    /// submit and block until no request is in flight
+    void wait();
+    /// deliver completions on `pool` from a reaper thread, nullptr - through poll() and wait().
+    /// Without io_uring the requests themselves run on the pool
+    void setCompletionPool(common::ThreadPool* pool);
+
+    bool usesIoUring() const { return ring != nullptr; }
+    const options& getOptions() const { return opts; }
+
+private:
+    struct ringState;
+    struct request;
+    struct completionJob;
+
+    bool setupRing();
+    void destroyRing();
+    void allocateBuffers();
+    /// run requests to the end on the calling thread, one system call with io_uring
+    void runBatch(request* requests, size_t count);
+    /// pread/pwrite path of a request, returns bytes or -errno
+    long runFallback(request* req);
+    /// synchronous transfer of the buffers at `offset`
+    size_t transfer(bool write, const IoBuffer* buffers, size_t count, uint64_t offset);
+    /// transfer through the aligned bounce buffers for O_DIRECT
+    size_t transferDirect(bool write, const IoBuffer* buffers, size_t count, uint64_t offset);
+    void queueAsync(request* req);
+    /// push a request to the submission queue, ringMutex is held; false if it is full
+    bool pushRequest(request* req);
+    /// submit everything pushed and wait for `minComplete` completions, ringMutex is held
+    int enterLocked(unsigned minComplete, bool getEvents);
+    /// push a request, waiting for room in the ring; ringMutex is held, completions taken meanwhile
+    /// are appended to `finished`
+    void pushLocked(request* req, std::vector<request*>& finished);
+    /// submit everything pushed, ringMutex is held; completions taken meanwhile are appended to `finished`
+    void submitLocked(std::vector<request*>& finished);
+    /// take arrived completions, ringMutex is held; async ones are appended to `finished`
+    void reapLocked(std::vector<request*>& finished);
+    /// run callbacks of async requests, no lock held
+    void dispatch(std::vector<request*>& finished);
+    void finishAsync(request* req);
+    /// raise filesize to `end` unless a concurrent write got further
+    void extendSize(size_t end);
+    void reaperLoop();
+    void stopReaper();
+
+    std::string filename;
+    FileMode accessMode;
+    options opts;
+    int fd;
+    // grown by positional and async writes from any thread
+    std::atomic<size_t> filesize;
+    size_t curPos;
+
+    ringState* ring;
+    // bounce buffers for O_DIRECT, registered with the ring when possible
+    uint8_t* buffers;
+    bool buffersRegistered;
+    // direct transfers share the bounce buffers
+    std::mutex bufferMutex;
+
+    // guards the ring and the requests of the pread/pwrite fallback
+    std::mutex ringMutex;
+    std::vector<request*> queued;
+    std::vector<request*> completed;
+    // queued in the submission ring but not submitted
+    unsigned unsubmitted;
+    // pushed to the ring and not reaped yet, waiting for a completion only makes sense with some;
+    // kept within the completion queue size
+    unsigned inRing;
+
+    common::ThreadPool* completionPool;
+    std::thread reaper;
+    // set to stop the reaper, cleared by it on exit
+    std::atomic<bool> stopping;
+
+    std::atomic<size_t> inFlight;
+    std::mutex idleMutex;
+    std::condition_variable idle;
+};
+
+}}
@@ -0,0 +1,164 @@
+#include "filesystem/line_scanner.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SB_SCAN_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// per-function instruction sets, so the rest of the build needs no -mavx2
+#if defined(__GNUC__) || defined(__clang__)
+#define SB_TARGET(x) __attribute__((target(x)))
+#else
+#define SB_TARGET(x)
+#endif
+
+namespace sb { namespace filesystem {
+
+namespace {
+
+typedef const unsigned char* (*scanFunc)(const unsigned char*, const unsigned char*);
+
+struct scanner
+{
+    scanFunc scan;
+    const char* name;
+};
+
+const unsigned char* scanScalar(const unsigned char* begin, const unsigned char* end)
+{
+    return static_cast<const unsigned char*>(memchr(begin, '\n', end - begin));
+}
+
+#ifdef SB_SCAN_X86
+
+inline unsigned lowestBit(unsigned mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+SB_TARGET("sse2")
+const unsigned char* scanSse2(const unsigned char* begin, const unsigned char* end)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; end - begin >= 16; begin += 16)
+    {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+        unsigned mask = unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
+        if (mask)
+            return begin + lowestBit(mask);
+    }
+    return scanScalar(begin, end);
+}
+
+SB_TARGET("avx2")
+const unsigned char* scanAvx2(const unsigned char* begin, const unsigned char* end)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    // two blocks per iteration, one test for both while no newline is found
+    for (; end - begin >= 64; begin += 64)
+    {
+        __m256i low = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin)), newline);
+        __m256i high = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin + 32)), newline);
+        if (!_mm256_testz_si256(_mm256_or_si256(low, high), _mm256_or_si256(low, high)))
+        {
+            unsigned mask = unsigned(_mm256_movemask_epi8(low));
+            if (mask)
+                return begin + lowestBit(mask);
+            return begin + 32 + lowestBit(unsigned(_mm256_movemask_epi8(high)));
+        }
+    }
+    for (; end - begin >= 32; begin += 32)
+    {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+        unsigned mask = unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline)));
+        if (mask)
+            return begin + lowestBit(mask);
+    }
+    return scanScalar(begin, end);
+}
+
+bool cpuHasAvx2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    // AVX and OS support for saving the ymm registers
+    bool osAvx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+    if (!osAvx)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+bool cpuHasSse2()
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    return true;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+
+#endif
+
+scanner pickScanner()
+{
+    scanner res;
+#ifdef SB_SCAN_X86
+    if (cpuHasAvx2())
+    {
+        res.scan = scanAvx2;
+        res.name = "avx2";
+        return res;
+    }
+    if (cpuHasSse2())
+    {
+        res.scan = scanSse2;
+        res.name = "sse2";
+        return res;
+    }
+#endif
+    res.scan = scanScalar;
+    res.name = "scalar";
+    return res;
+}
+
+const scanner& currentScanner()
+{
+    // initialization of a function-local static is thread-safe
+    static const scanner selected = pickScanner();
+    return selected;
+}
+
+}
+
+const unsigned char* findNewline(const unsigned char* begin, const unsigned char* end)
+{
+    return currentScanner().scan(begin, end);
+}
+
+const char* newlineScannerName()
+{
+    return currentScanner().name;
+}
+
+}}
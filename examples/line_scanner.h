@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstddef>
+
+namespace sb { namespace filesystem {
+
+/// First '\n' in [begin, end), nullptr if there is none.
+/// Uses AVX2 or SSE2 when the CPU supports it, checked once at the first call; memchr elsewhere
+const unsigned char* findNewline(const unsigned char* begin, const unsigned char* end);
+
+/// implementation picked for this CPU: "avx2", "sse2" or "scalar"
+const char* newlineScannerName();
+
+}}
@@ -1,15 +1,65 @@
 #include <stdexcept>
 #include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 
 #include "filesystem/memory_file_data_stream.h"
+#include "common/ThreadPool.h"
 
 namespace  sb { namespace filesystem {
 
+struct MemoryDataStream::readAheadState
+{
+    ~readAheadState() { releaseSharedFields(fields); }
+
+    sb::common::ThreadPool* pool;
+    // own file handle, the last job closes it
+    memMapPlatformFields* fields;
+    size_t distance;
+    size_t chunk;
+    size_t maxInFlight;
+    // end of the range already requested, owned by the reading thread
+    uint64_t next;
+    std::atomic<size_t> inFlight;
+    std::atomic<bool> stopped;
+};
+
+/// pool callable; the in-flight count drops when it is destroyed, which also covers
+/// tasks the pool abandons on stop without running them. It keeps the state alive,
+/// so the stream doesn't wait for it on close
+struct MemoryDataStream::readAheadJob
+{
+    std::shared_ptr<readAheadState> state;
+    uint64_t offset;
+    size_t size;
+
+    readAheadJob(const std::shared_ptr<readAheadState>& stateParam, uint64_t offsetParam, size_t sizeParam) :
+        state(stateParam), offset(offsetParam), size(sizeParam) {}
+    readAheadJob(readAheadJob&& other) :
+        state(std::move(other.state)), offset(other.offset), size(other.size) {}
+    readAheadJob(const readAheadJob&) = delete;
+    ~readAheadJob()
+    {
+        if (state)
+            --state->inFlight;
+    }
+
+    void operator()()
+    {
+        if (!state->stopped.load())
+            warmFileRange(state->fields, offset, size);
+    }
+};
+
 
 MemoryFileId::MemoryFileId(const std::string& fname, FileMode access_mode_param)
 {
-    fileId = new fileIdPlatform();
-    fileId->initData(fname, access_mode_param);
+    std::unique_ptr<fileIdPlatform> id(new fileIdPlatform());
+    // throws when the file can't be stat'ed
+    id->initData(fname, access_mode_param);
+    fileId = id.release();
 }
 
 MemoryFileId::~MemoryFileId()
@@ -38,52 +88,148 @@ bool MemoryFileId::operator<(const MemoryFileId& other) const
     return  *getFileId() < *other.getFileId();
 }
 
+size_t MemoryFileId::hash() const
+{
+    return fileId->hash();
+}
 
-size_t MemoryDataStream::write(uint8_t* buffer, size_t size)
+
+struct FlushHandle::state
 {
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool done = false;
+    bool ok = false;
 
-    size_t amount = std::min(size, filesize - curPos);
-    if (amount)
+    void complete(bool result)
     {
-        uint8_t* ptr = static_cast<uint8_t*>(mappedView);
-        memcpy(ptr + curPos, buffer, amount);
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        ok = result;
+        cond.notify_all();
     }
+};
 
-    curPos += amount;
-    return amount;
+bool FlushHandle::isDone() const
+{
+    if (!batch)
+        return true;
+    std::lock_guard<std::mutex> lock(batch->mutex);
+    return batch->done;
 }
 
-/// seek to absolute position if from_current==false else to relative from current
-bool MemoryDataStream::seek(std::streamoff offset, bool fromCurrent)
+bool FlushHandle::wait() const
 {
-    if (!fromCurrent)
+    if (!batch)
+        return false;
+    std::unique_lock<std::mutex> lock(batch->mutex);
+    batch->cond.wait(lock, [this]() { return batch->done; });
+    return batch->ok;
+}
+
+struct MemoryDataStream::flushState
+{
+    flushState() : fields(nullptr) {}
+    ~flushState() { releaseSharedFields(fields); }
+
+    std::mutex mutex;
+    // own file handle made by the first flushAsync, the last job closes it
+    memMapPlatformFields* fields;
+    // batch still waiting for a worker, later group commit requests join it
+    std::shared_ptr<FlushHandle::state> open;
+};
+
+/// pool callable of flushAsync; a batch the pool abandons on stop completes as failed.
+/// It keeps the state alive, so the stream doesn't wait for it on close
+struct MemoryDataStream::flushJob
+{
+    std::shared_ptr<flushState> state;
+    std::shared_ptr<FlushHandle::state> batch;
+
+    flushJob(const std::shared_ptr<flushState>& stateParam, const std::shared_ptr<FlushHandle::state>& batchParam) :
+        state(stateParam), batch(batchParam) {}
+    flushJob(flushJob&& other) :
+        state(std::move(other.state)), batch(std::move(other.batch)) {}
+    flushJob(const flushJob&) = delete;
+    ~flushJob()
     {
-        if (offset < filesize)
-        {
-            curPos = offset;
-            return true;
-        }
+        if (!state || !batch)
+            return;
+        close();
+        batch->complete(false);
     }
-    else
+
+    void operator()()
     {
-        if (curPos + offset < filesize)
-        {
-            curPos += offset;
-        }
+        close();
+        batch->complete(syncFile(state->fields));
+        batch.reset();
     }
 
-    return false;
+    /// requests arriving from now on need another sync
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (state->open == batch)
+            state->open.reset();
+    }
+};
+
+size_t MemoryDataStream::write(uint8_t* buffer, size_t size)
+{
+    size_t done = copyTo(curPos, buffer, writableBytes(curPos, size));
+    markDirty(curPos, done);
+    curPos += done;
+    if (curPos > filesize)
+        filesize = curPos;
+    return done;
+}
+
+const uint8_t* MemoryDataStream::readDirect(size_t& size)
+{
+    size = 0;
+    if (curPos >= filesize)
+        return nullptr;
 
+    size_t available = 0;
+    const uint8_t* ptr = windowFor(curPos, 1, available);
+    if (!ptr)
+        return nullptr;
+    size = std::min(available, filesize - curPos);
+    curPos += size;
+    scheduleReadAhead();
+    return ptr;
+}
+
+/// seek to absolute position if from_current==false else to relative from current
+bool MemoryDataStream::seek(std::streamoff offset, bool fromCurrent)
+{
+    std::streamoff target = fromCurrent ? std::streamoff(curPos) + offset : offset;
+    if (target < 0)
+        return false;
+
+    // a growable stream may go to its end, to append after rewriting a header
+    if (size_t(target) < filesize || (isGrowable() && size_t(target) == filesize))
+    {
+        curPos = size_t(target);
+        return true;
+    }
+    return false;
 }
 
 void MemoryDataStream::addRef()
 {
-    ++referenceCount;
+    referenceCount.fetch_add(1, std::memory_order_relaxed);
 }
 
 bool MemoryDataStream::hasRef()
 {
-    return referenceCount > 0;
+    return referenceCount.load() > 0;
+}
+
+int MemoryDataStream::useCount() const
+{
+    return referenceCount.load(std::memory_order_acquire);
 }
 
 bool MemoryDataStream::eof()
@@ -99,33 +245,198 @@ size_t MemoryDataStream::tell()
 
 std::shared_ptr<DataStream> MemoryDataStream::clone()
 {
-    throw std::logic_error("Can't clone memory mapped file");
+    return createCursor();
 };
 
-MemoryDataStream::sptr MemoryDataStream::open(const std::string& fn, FileMode mode, size_t dataSize)
+MemoryStreamCursor::sptr MemoryDataStream::createCursor()
+{
+    return std::make_shared<MemoryStreamCursor>(shared_from_this());
+}
+
+MemoryStreamCursor::MemoryStreamCursor(const MemoryDataStream::sptr& streamParam) :
+    stream(streamParam),
+    base(nullptr),
+    size(streamParam->getSize()),
+    curPos(0),
+    windowView(nullptr),
+    windowOffset(0),
+    windowBytes(0)
+{
+    stream->addRef();
+    // growing or windowed streams replace their mappings, so a cursor maps its own window then
+    if (!stream->isWindowed() && !stream->isGrowable())
+        base = static_cast<uint8_t*>(stream->mappedView);
+}
+
+MemoryStreamCursor::~MemoryStreamCursor()
+{
+    close();
+}
+
+void MemoryStreamCursor::close()
+{
+    if (!stream)
+        return;
+    releaseWindow();
+    stream->close();
+    stream.reset();
+    base = nullptr;
+    size = 0;
+}
+
+std::shared_ptr<DataStream> MemoryStreamCursor::clone()
+{
+    if (!stream)
+        throw std::logic_error("Can't clone closed cursor");
+    return std::make_shared<MemoryStreamCursor>(stream);
+}
+
+bool MemoryStreamCursor::seek(std::streamoff offset, bool fromCurrent)
+{
+    std::streamoff target = fromCurrent ? std::streamoff(curPos) + offset : offset;
+    if (target < 0 || size_t(target) > size)
+        return false;
+    curPos = size_t(target);
+    return true;
+}
+
+uint8_t* MemoryStreamCursor::windowFor(uint64_t offset, size_t& available)
+{
+    available = 0;
+    if (offset >= size)
+        return nullptr;
+    if (base)
+    {
+        available = size - offset;
+        return base + offset;
+    }
+
+    if (offset - windowOffset >= windowBytes || !windowView)
+    {
+        releaseWindow();
+        uint64_t start = offset & ~uint64_t(stream->getPageSize() - 1);
+        size_t bytesToMap = static_cast<size_t>(std::min<uint64_t>(stream->windowSize, size - start));
+        void* view = stream->memMap(bytesToMap, start);
+        if (!view)
+            return nullptr;
+        windowView = view;
+        windowOffset = start;
+        windowBytes = bytesToMap;
+    }
+
+    available = static_cast<size_t>(windowOffset + windowBytes - offset);
+    return static_cast<uint8_t*>(windowView) + (offset - windowOffset);
+}
+
+void MemoryStreamCursor::releaseWindow()
+{
+    if (windowView)
+        stream->memUnmap(windowView, windowBytes);
+    windowView = nullptr;
+    windowOffset = 0;
+    windowBytes = 0;
+}
+
+size_t MemoryStreamCursor::read(uint8_t* buffer, size_t count)
+{
+    size_t amount = curPos < size ? std::min(count, size - curPos) : 0;
+    size_t done = 0;
+    while (done < amount)
+    {
+        size_t available = 0;
+        const uint8_t* ptr = windowFor(curPos + done, available);
+        if (!ptr)
+            break;
+        size_t chunk = std::min(available, amount - done);
+        memcpy(buffer + done, ptr, chunk);
+        done += chunk;
+    }
+
+    curPos += done;
+    return done;
+}
+
+const uint8_t* MemoryStreamCursor::readDirect(size_t& size)
 {
-    auto stream = std::make_shared<MemoryDataStream>(fn, mode, dataSize);
+    const uint8_t* ptr = windowFor(curPos, size);
+    curPos += size;
+    return ptr;
+}
+
+size_t MemoryStreamCursor::write(uint8_t* buffer, size_t count)
+{
+    // a read-only stream is mapped without write access
+    if (stream->accessMode == FileMode::READ)
+        return 0;
+
+    size_t amount = curPos < size ? std::min(count, size - curPos) : 0;
+    size_t done = 0;
+    while (done < amount)
+    {
+        size_t available = 0;
+        uint8_t* ptr = windowFor(curPos + done, available);
+        if (!ptr)
+            break;
+        size_t chunk = std::min(available, amount - done);
+        memcpy(ptr, buffer + done, chunk);
+        done += chunk;
+    }
+
+    stream->markDirty(curPos, done);
+    curPos += done;
+    return done;
+}
+
+MemoryDataStream::sptr MemoryDataStream::open(const std::string& fn, FileMode mode, size_t dataSize,
+                                              allocator_flags flags, size_t windowSize, CacheHint hint)
+{
+    auto stream = std::make_shared<MemoryDataStream>(fn, mode, dataSize, flags, windowSize, hint);
     return stream->isValid() ? stream : nullptr;
 }
 
-MemoryDataStream::MemoryDataStream()
+MemoryDataStream::MemoryDataStream() :
+	filesize(0),
+	capacity(0),
+	hint(CacheHint::Normal),
+	accessMode(FileMode::READ),
+	flags(allocator_flags::MAP_WHOLE_FILE),
+	windowSize(DEFAULT_WINDOW_SIZE),
+	mappedBytes(0),
+	mappedOffset(0),
+	curPos(0),
+	referenceCount(0),
+	mmPlatformFields(nullptr),
+	mappedView(nullptr),
+	windowClock(0),
+	flushes(std::make_shared<flushState>()),
+	groupCommit(false)
 {
 }
 
 MemoryDataStream::~MemoryDataStream()
 {
+	stopReadAhead();
 	close();
 	deletePlatformFields();
 }
 
-MemoryDataStream::MemoryDataStream(const std::string& fname, FileMode accessModeParam, size_t dataSize) :
+MemoryDataStream::MemoryDataStream(const std::string& fname, FileMode accessModeParam, size_t dataSize,
+                                   allocator_flags flagsParam, size_t windowSizeParam, CacheHint hintParam) :
 	filename(fname),
 	filesize(0),
-	hint(CacheHint::Normal),
+	capacity(0),
+	hint(hintParam),
+	accessMode(accessModeParam),
+	flags(flagsParam),
+	windowSize(windowSizeParam),
 	mappedBytes(0),
+	mappedOffset(0),
 	curPos(0),
 	referenceCount(1),
-	mappedView(nullptr)
+	mappedView(nullptr),
+	windowClock(0),
+	flushes(std::make_shared<flushState>()),
+	groupCommit(false)
 {
 
 	initPlatformFields();
@@ -139,27 +450,88 @@ MemoryDataStream::MemoryDataStream(const std::string& fname, FileMode accessMode
 	if (bytesToMap < dataSize)
 		bytesToMap = dataSize;
 
-	remap(0, bytesToMap);
+	if (isGrowable())
+	{
+		// an empty mapping is not possible, reserve room for the first writes
+		bytesToMap = UPPER_ALIGN_TO_PAGE(std::max(bytesToMap, MIN_GROWTH));
+		if (bytesToMap > filesize)
+			resizeFile(bytesToMap);
+		capacity = getFileSize();
+		if (accessMode == FileMode::APPEND)
+			curPos = filesize;
+	}
+	else if (isWindowed())
+	{
+		// windows never extend the file, grow it up front
+		if (bytesToMap > filesize && accessMode != FileMode::READ && resizeFile(bytesToMap))
+			filesize = getFileSize();
+		capacity = filesize;
+	}
+	else
+	{
+		capacity = filesize;
+	}
+
+	if (isWindowed())
+	{
+		windowSize = std::max<size_t>(UPPER_ALIGN_TO_PAGE(windowSize), getPageSize());
+		size_t available = 0;
+		windowFor(0, 1, available);
+	}
+	else
+	{
+		remap(0, std::max(bytesToMap, capacity));
+	}
 
-    filesize = getFileSize();
+	if (!isGrowable())
+	{
+		filesize = getFileSize();
+		capacity = filesize;
+	}
 }
 
 
 void MemoryDataStream::close()
 {
-    if (--referenceCount > 0)
+    if (referenceCount.fetch_sub(1, std::memory_order_acq_rel) > 1)
     {
         return;
     }
+    shutdown();
+}
+
+bool MemoryDataStream::closeIfLast()
+{
+    int expected = 1;
+    if (!referenceCount.compare_exchange_strong(expected, 0, std::memory_order_acq_rel))
+        return false;
+    shutdown();
+    return true;
+}
 
-	closeMappedFile();
+void MemoryDataStream::shutdown()
+{
+	stopReadAhead();
+	// running flush jobs keep the old state and its file handle
+	flushes = std::make_shared<flushState>();
+	releaseWindows();
+	// give back the room reserved for writes
+	if (isGrowable() && capacity > filesize && resizeFile(filesize))
+		capacity = filesize;
+	if (mmPlatformFields)
+		closeMappedFile();
     mappedView = nullptr;
     filesize = 0;
+    capacity = 0;
 }
 
 uint8_t MemoryDataStream::operator[](size_t offset) const
 {
-    return static_cast<uint8_t*>(mappedView)[offset];
+    if (offset - mappedOffset < mappedBytes)
+        return static_cast<uint8_t*>(mappedView)[offset - mappedOffset];
+
+    size_t available = 0;
+    return *windowFor(offset, 1, available);
 }
 
 uint8_t MemoryDataStream::at(size_t offset) const
@@ -175,21 +547,141 @@ uint8_t MemoryDataStream::at(size_t offset) const
 /// raw access
 const uint8_t* MemoryDataStream::getData() const
 {
-    return static_cast<const uint8_t*>(mappedView);
+    return isWindowed() ? nullptr : static_cast<const uint8_t*>(mappedView);
 }
 
 /// read `size` bytes to buffer, return realy readed bytes
 size_t MemoryDataStream::read(uint8_t* buffer, size_t size)
 {
-    size_t amount = std::min(size, filesize - curPos);
-    if(amount)
+    size_t amount = curPos < filesize ? std::min(size, filesize - curPos) : 0;
+    size_t done = copyFrom(curPos, buffer, amount);
+    curPos += done;
+    scheduleReadAhead();
+    return done;
+}
+
+size_t MemoryDataStream::readv(const IoBuffer* buffers, size_t count)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i)
+        total += buffers[i].size;
+    size_t amount = curPos < filesize ? std::min(total, filesize - curPos) : 0;
+
+    size_t done = 0;
+    for (size_t i = 0; i < count && done < amount; ++i)
     {
-        uint8_t * ptr = static_cast<uint8_t*>(mappedView);
-        memcpy(buffer, ptr + curPos, amount);
+        size_t chunk = std::min(buffers[i].size, amount - done);
+        size_t copied = copyFrom(curPos + done, buffers[i].data, chunk);
+        done += copied;
+        if (copied < chunk)
+            break;
     }
 
-    curPos += amount;
-    return amount;
+    curPos += done;
+    scheduleReadAhead();
+    return done;
+}
+
+size_t MemoryDataStream::writev(const IoBuffer* buffers, size_t count)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i)
+        total += buffers[i].size;
+    size_t amount = writableBytes(curPos, total);
+
+    size_t done = 0;
+    for (size_t i = 0; i < count && done < amount; ++i)
+    {
+        size_t chunk = std::min(buffers[i].size, amount - done);
+        size_t copied = copyTo(curPos + done, buffers[i].data, chunk);
+        done += copied;
+        if (copied < chunk)
+            break;
+    }
+
+    markDirty(curPos, done);
+    curPos += done;
+    if (curPos > filesize)
+        filesize = curPos;
+    return done;
+}
+
+size_t MemoryDataStream::pread(uint8_t* buffer, size_t size, size_t offset)
+{
+    if (offset >= filesize)
+        return 0;
+    return copyFrom(offset, buffer, std::min(size, filesize - offset));
+}
+
+size_t MemoryDataStream::pwrite(uint8_t* buffer, size_t size, size_t offset)
+{
+    size_t done = copyTo(offset, buffer, writableBytes(offset, size));
+    markDirty(offset, done);
+    if (offset + done > filesize)
+        filesize = offset + done;
+    return done;
+}
+
+size_t MemoryDataStream::writableBytes(uint64_t offset, size_t size)
+{
+    if (accessMode == FileMode::READ)
+        return 0;
+    if (isGrowable() && offset + size > capacity)
+        ensureCapacity(offset + size);
+
+    size_t limit = isGrowable() ? capacity : filesize;
+    return offset < limit ? static_cast<size_t>(std::min<uint64_t>(size, limit - offset)) : 0;
+}
+
+size_t MemoryDataStream::copyFrom(uint64_t offset, uint8_t* buffer, size_t size) const
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        // the current mapping needs no window lookup, so reads of a whole-file mapping share no state
+        size_t available = 0;
+        const uint8_t* ptr = nullptr;
+        if (offset + done - mappedOffset < mappedBytes)
+        {
+            ptr = static_cast<const uint8_t*>(mappedView) + (offset + done - mappedOffset);
+            available = static_cast<size_t>(mappedOffset + mappedBytes - offset - done);
+        }
+        else
+        {
+            ptr = windowFor(offset + done, 1, available);
+        }
+        if (!ptr)
+            break;
+        size_t chunk = std::min(available, size - done);
+        memcpy(buffer + done, ptr, chunk);
+        done += chunk;
+    }
+    return done;
+}
+
+size_t MemoryDataStream::copyTo(uint64_t offset, const uint8_t* buffer, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        size_t available = 0;
+        uint8_t* ptr = nullptr;
+        if (offset + done - mappedOffset < mappedBytes)
+        {
+            ptr = static_cast<uint8_t*>(mappedView) + (offset + done - mappedOffset);
+            available = static_cast<size_t>(mappedOffset + mappedBytes - offset - done);
+        }
+        else
+        {
+            ptr = windowFor(offset + done, 1, available);
+        }
+        if (!ptr)
+            break;
+        size_t chunk = std::min(available, size - done);
+        memcpy(ptr, buffer + done, chunk);
+        done += chunk;
+    }
+    return done;
 }
 
 /// true, if file successfully opened
@@ -209,17 +701,57 @@ size_t MemoryDataStream::mappedSize() const
     return mappedBytes;
 }
 
+size_t MemoryDataStream::mappedTotal() const
+{
+    std::lock_guard<std::mutex> lock(windowMutex);
+    size_t res = 0;
+    for (auto& window : windows)
+        res += window.bytes;
+    return res;
+}
+
+bool MemoryDataStream::isWindowed() const
+{
+    return hasFlag(flags, allocator_flags::ALLOW_REMAP) && !hasFlag(flags, allocator_flags::MAP_WHOLE_FILE);
+}
+
+const size_t MemoryDataStream::MIN_GROWTH;
+
+bool MemoryDataStream::isGrowable() const
+{
+    return accessMode == FileMode::WRITE || accessMode == FileMode::APPEND;
+}
+
+bool MemoryDataStream::reserve(size_t size)
+{
+    return isGrowable() && ensureCapacity(size);
+}
+
+bool MemoryDataStream::ensureCapacity(size_t required)
+{
+    if (required <= capacity)
+        return true;
+
+    // doubling keeps the number of resizes and remaps logarithmic in the final size
+    size_t newCapacity = UPPER_ALIGN_TO_PAGE(std::max(required, std::max(capacity * 2, MIN_GROWTH)));
+    if (!resizeFile(newCapacity))
+        return false;
+    capacity = newCapacity;
+
+    // windows map the new tail on demand
+    if (isWindowed())
+        return true;
+    return remap(0, capacity);
+}
+
 // replace mapping by a new one of the same file, offset MUST be a multiple of the page size
 bool MemoryDataStream::remap(uint64_t offset, size_t bytesToMap)
 {
-    if (mappedView)
-    {
-        memUnmap();
-        mappedView = nullptr;
-    }
+    std::lock_guard<std::mutex> lock(windowMutex);
+    retireWindows();
 
     // don't go further than end of file
-    if (offset > filesize)
+    if (offset > std::max(filesize, capacity))
         return false;
     //if (offset + bytesToMap > filesize)
     //    bytesToMap = size_t(filesize - offset);
@@ -228,58 +760,621 @@ bool MemoryDataStream::remap(uint64_t offset, size_t bytesToMap)
 
 	if (mappedView)
 	{
-		mappedBytes = bytesToMap - offset;
+		mappedBytes = bytesToMap;
+		mappedOffset = offset;
+		mappedWindow window = { offset, bytesToMap, mappedView, ++windowClock, 0, false };
+		windows.push_back(window);
 	}
 
     return mappedView ? true : false;
 }
 
+uint8_t* MemoryDataStream::windowFor(uint64_t offset, size_t minBytes, size_t& available) const
+{
+    std::lock_guard<std::mutex> lock(windowMutex);
+    available = 0;
+    if (offset < capacity)
+        minBytes = static_cast<size_t>(std::min<uint64_t>(minBytes, capacity - offset));
 
-MemoryFilePool::sptr MemoryFilePool::_instance = nullptr;
+    mappedWindow* found = nullptr;
+    for (auto& window : windows)
+    {
+        if (window.retired)
+            continue;
+        if (offset - window.offset < window.bytes && window.offset + window.bytes - offset >= minBytes)
+        {
+            found = &window;
+            break;
+        }
+    }
 
-MemoryFilePool::sptr MemoryFilePool::instance()
+    if (!found)
+    {
+        if (!isWindowed() || offset >= capacity)
+            return nullptr;
+
+        // pinned windows stay, the cache may temporarily hold more than MAX_WINDOWS
+        while (windows.size() >= MAX_WINDOWS)
+        {
+            auto lru = windows.end();
+            for (auto it = windows.begin(); it != windows.end(); ++it)
+            {
+                if (!it->pins && !it->retired && (lru == windows.end() || it->lastUse < lru->lastUse))
+                    lru = it;
+            }
+            if (lru == windows.end())
+                break;
+            memUnmap(lru->view, lru->bytes);
+            windows.erase(lru);
+        }
+
+        uint64_t start = ALIGN_TO_PAGE(offset);
+        // a view across the window boundary gets a window of its own
+        uint64_t wanted = std::max<uint64_t>(windowSize, UPPER_ALIGN_TO_PAGE(offset + minBytes) - start);
+        size_t bytesToMap = static_cast<size_t>(std::min<uint64_t>(wanted, capacity - start));
+        void* view = memMap(bytesToMap, start);
+        if (!view)
+            return nullptr;
+
+        mappedWindow window = { start, bytesToMap, view, 0, 0, false };
+        windows.push_back(window);
+        found = &windows.back();
+    }
+
+    found->lastUse = ++windowClock;
+    mappedView = found->view;
+    mappedBytes = found->bytes;
+    mappedOffset = found->offset;
+
+    available = static_cast<size_t>(found->offset + found->bytes - offset);
+    return static_cast<uint8_t*>(found->view) + (offset - found->offset);
+}
+
+std::vector<std::pair<void*, size_t>> MemoryDataStream::mappedPages(uint64_t offset, size_t size) const
 {
-    if( !_instance )
+    std::vector<std::pair<void*, size_t>> res;
+    for (auto& window : windows)
     {
-        _instance = MemoryFilePool::sptr(new MemoryFilePool());
+        uint64_t first = std::max(offset, window.offset);
+        uint64_t last = std::min<uint64_t>(offset + size, window.offset + window.bytes);
+        if (first >= last)
+            continue;
+        // views start at a page boundary, so page alignment of file offsets carries over
+        first = ALIGN_TO_PAGE(first);
+        res.push_back(std::make_pair(static_cast<uint8_t*>(window.view) + (first - window.offset),
+                                     static_cast<size_t>(last - first)));
     }
+    return res;
+}
 
-    return _instance;
+MemoryDataStream::mappedWindow* MemoryDataStream::findWindow(const void* ptr) const
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(ptr);
+    for (auto& window : windows)
+    {
+        const uint8_t* view = static_cast<const uint8_t*>(window.view);
+        if (bytes >= view && bytes < view + window.bytes)
+            return &window;
+    }
+    return nullptr;
 }
-MemoryDataStream::sptr MemoryFilePool::openFile(const std::string& fname, FileMode mode)
+
+void MemoryDataStream::pinWindow(const void* ptr) const
 {
-    MemoryFileId id(fname, mode);
+    std::lock_guard<std::mutex> lock(windowMutex);
+    if (mappedWindow* window = findWindow(ptr))
+        ++window->pins;
+}
+
+void MemoryDataStream::unpinWindow(const void* ptr) const
+{
+    std::lock_guard<std::mutex> lock(windowMutex);
+    mappedWindow* window = findWindow(ptr);
+    if (!window || --window->pins > 0 || !window->retired)
+        return;
+
+    memUnmap(window->view, window->bytes);
+    windows.erase(windows.begin() + (window - windows.data()));
+}
+
+MemoryView MemoryDataStream::readView(size_t size)
+{
+    size_t amount = curPos < filesize ? std::min(size, filesize - curPos) : 0;
+    if (!amount)
+        return MemoryView();
+
+    size_t available = 0;
+    const uint8_t* ptr = windowFor(curPos, amount, available);
+    if (!ptr)
+        return MemoryView();
+
+    amount = std::min(amount, available);
+    curPos += amount;
+    scheduleReadAhead();
+    return MemoryView(this, ptr, amount);
+}
+
+MemoryView MemoryDataStream::peek(size_t offset, size_t size) const
+{
+    if (offset > filesize || size > filesize - offset)
+        throw std::out_of_range("View is not large enough");
+    if (!size)
+        return MemoryView();
+
+    size_t available = 0;
+    const uint8_t* ptr = windowFor(offset, size, available);
+    if (!ptr || available < size)
+        throw std::runtime_error("Can't map view of " + filename);
+
+    return MemoryView(this, ptr, size);
+}
+
+MemoryView::MemoryView(const MemoryDataStream* streamParam, const uint8_t* ptrParam, size_t lengthParam) :
+    stream(streamParam),
+    ptr(ptrParam),
+    length(lengthParam)
+{
+    stream->pinWindow(ptr);
+}
+
+MemoryView::MemoryView(const MemoryView& other) :
+    stream(other.stream),
+    ptr(other.ptr),
+    length(other.length)
+{
+    if (stream)
+        stream->pinWindow(ptr);
+}
 
-    auto it = theMap.find(id);
-    if (it != theMap.end())
+MemoryView::MemoryView(MemoryView&& other) :
+    stream(other.stream),
+    ptr(other.ptr),
+    length(other.length)
+{
+    other.stream = nullptr;
+    other.ptr = nullptr;
+    other.length = 0;
+}
+
+MemoryView& MemoryView::operator=(MemoryView other)
+{
+    std::swap(stream, other.stream);
+    std::swap(ptr, other.ptr);
+    std::swap(length, other.length);
+    return *this;
+}
+
+MemoryView::~MemoryView()
+{
+    if (stream)
+        stream->unpinWindow(ptr);
+}
+
+uint8_t MemoryView::at(size_t offset) const
+{
+    if (offset >= length)
+        throw std::out_of_range("View is not large enough");
+    return ptr[offset];
+}
+
+MemoryView MemoryView::subview(size_t offset, size_t size) const
+{
+    if (offset >= length || !size)
+        return MemoryView();
+    return MemoryView(stream, ptr + offset, std::min(size, length - offset));
+}
+
+void MemoryDataStream::setReadAhead(sb::common::ThreadPool* pool, size_t distance, size_t chunk, size_t maxInFlight)
+{
+    stopReadAhead();
+    if (!pool || !distance || !mmPlatformFields)
+        return;
+
+    memMapPlatformFields* fields = shareFields(mmPlatformFields);
+    if (!fields)
+        return;
+    readAhead = std::make_shared<readAheadState>();
+    readAhead->pool = pool;
+    readAhead->fields = fields;
+    readAhead->distance = distance;
+    readAhead->chunk = std::max<size_t>(std::min(chunk, distance), 1);
+    readAhead->maxInFlight = std::max<size_t>(maxInFlight, 1);
+    readAhead->next = curPos;
+    readAhead->inFlight = 0;
+    readAhead->stopped = false;
+    scheduleReadAhead();
+}
+
+void MemoryDataStream::scheduleReadAhead()
+{
+    if (!readAhead)
+        return;
+
+    readAheadState& state = *readAhead;
+    // position jumped, restart from it
+    if (state.next < curPos || state.next > curPos + state.distance)
+        state.next = curPos;
+
+    uint64_t target = std::min<uint64_t>(curPos + state.distance, filesize);
+    while (state.next < target && state.inFlight.load() < state.maxInFlight)
+    {
+        size_t size = static_cast<size_t>(std::min<uint64_t>(state.chunk, target - state.next));
+        // wait for a whole chunk unless the end of file is reached
+        if (size < state.chunk && target < filesize)
+            break;
+        ++state.inFlight;
+        state.pool->submit(readAheadJob(readAhead, state.next, size), sb::common::ThreadPool::priority::low);
+        state.next += size;
+    }
+}
+
+void MemoryDataStream::stopReadAhead()
+{
+    if (!readAhead)
+        return;
+
+    // queued tasks see the flag and return, running ones hold their own file handle
+    readAhead->stopped = true;
+    readAhead.reset();
+}
+
+void MemoryDataStream::retireWindows()
+{
+    for (auto it = windows.begin(); it != windows.end();)
     {
-        it->second->addRef();
-        return it->second;
+        if (it->pins)
+        {
+            it->retired = true;
+            ++it;
+            continue;
+        }
+        memUnmap(it->view, it->bytes);
+        it = windows.erase(it);
     }
-    else
+    mappedView = nullptr;
+    mappedBytes = 0;
+    mappedOffset = 0;
+}
+
+void MemoryDataStream::markDirty(uint64_t offset, size_t size)
+{
+    if (!size)
+        return;
+
+    uint64_t first = ALIGN_TO_PAGE(offset);
+    uint64_t last = UPPER_ALIGN_TO_PAGE(offset + size);
+    std::lock_guard<std::mutex> lock(dirtyMutex);
+    // merge with every range touching [first, last)
+    auto it = dirty.upper_bound(first);
+    if (it != dirty.begin() && std::prev(it)->second >= first)
+        --it;
+    while (it != dirty.end() && it->first <= last)
     {
-        MemoryDataStream::sptr file;
-        file = MemoryDataStream::open(fname, mode);
-        theMap.emplace(id, file);
-        return file;
+        first = std::min(first, it->first);
+        last = std::max(last, it->second);
+        it = dirty.erase(it);
     }
+    dirty[first] = last;
 }
 
-void MemoryFilePool::closeFile(const std::string& fname, FileMode mode)
+std::vector<std::pair<uint64_t, size_t>> MemoryDataStream::takeDirty(uint64_t offset, size_t size)
 {
+    std::vector<std::pair<uint64_t, size_t>> res;
+    uint64_t first = ALIGN_TO_PAGE(offset);
+    uint64_t last = size > capacity ? UINT64_MAX : UPPER_ALIGN_TO_PAGE(offset + size);
+
+    std::lock_guard<std::mutex> lock(dirtyMutex);
+    auto it = dirty.upper_bound(first);
+    if (it != dirty.begin() && std::prev(it)->second > first)
+        --it;
+    while (it != dirty.end() && it->first < last)
+    {
+        uint64_t start = it->first;
+        uint64_t end = it->second;
+        it = dirty.erase(it);
+        // keep the parts outside of the request dirty
+        if (start < first)
+        {
+            dirty[start] = first;
+            start = first;
+        }
+        if (end > last)
+        {
+            dirty[last] = end;
+            end = last;
+        }
+        res.push_back(std::make_pair(start, static_cast<size_t>(end - start)));
+    }
+    return res;
+}
+
+bool MemoryDataStream::save()
+{
+    return flushRange(0, SIZE_MAX);
+}
+
+bool MemoryDataStream::flushRange(size_t offset, size_t size)
+{
+    auto ranges = takeDirty(offset, size);
+    bool res = true;
+    for (auto& range : ranges)
+    {
+        if (!syncRange(range.first, range.second, true))
+            res = false;
+    }
+    // pages of evicted windows are no longer reachable through a mapping
+    if (!ranges.empty() && isWindowed() && !syncFile(mmPlatformFields))
+        res = false;
+    return res;
+}
+
+FlushHandle MemoryDataStream::flushAsync(sb::common::ThreadPool& pool, size_t offset, size_t size)
+{
+    // write-back is started on the calling thread through the mappings and only waited for on the pool
+    auto ranges = takeDirty(offset, size);
+    for (auto& range : ranges)
+        syncRange(range.first, range.second, false);
+
+    std::shared_ptr<FlushHandle::state> batch;
+    {
+        std::lock_guard<std::mutex> lock(flushes->mutex);
+        if (groupCommit && flushes->open)
+            return FlushHandle(flushes->open);
+
+        if (!flushes->fields && mmPlatformFields)
+            flushes->fields = shareFields(mmPlatformFields);
+        batch = std::make_shared<FlushHandle::state>();
+        if (!flushes->fields)
+        {
+            // no handle for the pool, sync here
+            batch->complete(mmPlatformFields && syncFile(mmPlatformFields));
+            return FlushHandle(batch);
+        }
+        if (groupCommit)
+            flushes->open = batch;
+    }
+    // the job may run inline or be rejected, either way it takes the lock itself
+    pool.submit(flushJob(flushes, batch));
+    return FlushHandle(batch);
+}
+
+void MemoryDataStream::releaseWindows()
+{
+    std::lock_guard<std::mutex> lock(windowMutex);
+    for (auto& window : windows)
+        memUnmap(window.view, window.bytes);
+    windows.clear();
+    mappedView = nullptr;
+    mappedBytes = 0;
+    mappedOffset = 0;
+}
+
+
+MemoryFilePool::sptr MemoryFilePool::instance()
+{
+    // initialization of a function-local static is thread-safe
+    static MemoryFilePool::sptr _instance(new MemoryFilePool());
+    return _instance;
+}
+
+MemoryFilePool::MemoryFilePool() :
+    maxMappedBytes(DEFAULT_MAX_MAPPED_BYTES),
+    maxOpenFiles(DEFAULT_MAX_OPEN_FILES),
+    mappedBytes(0),
+    openFiles(0),
+    hits(0),
+    misses(0),
+    evictions(0),
+    evictHand(0)
+{
+    for (auto& s : shards)
+        s.hand = s.theMap.end();
+}
+
+MemoryFilePool::shard& MemoryFilePool::shardFor(const MemoryFileId& id)
+{
+    return shards[id.hash() % SHARD_COUNT];
+}
+
+MemoryDataStream::sptr MemoryFilePool::openFile(const std::string& fname, FileMode mode, allocator_flags flags)
+{
+    if (hasFlag(flags, allocator_flags::BYPASS_FILE_POOL))
+        return MemoryDataStream::open(fname, mode, 0, flags);
+
+    // stat outside of the lock
     MemoryFileId id(fname, mode);
+    MemoryDataStream::sptr file;
+    {
+        shard& s = shardFor(id);
+        std::lock_guard<std::mutex> lock(s.mutex);
+
+        auto it = s.theMap.find(id);
+        if (it != s.theMap.end())
+        {
+            hits.fetch_add(1, std::memory_order_relaxed);
+            entry& e = it->second;
+            // an idle file starts over like a freshly opened one
+            if (e.stream->useCount() == 1)
+                e.stream->seek(0, false);
+            e.stream->addRef();
+            e.referenced = true;
+            e.keepForever = e.keepForever || hasFlag(flags, allocator_flags::KEEP_FOREVER);
+            return e.stream;
+        }
+
+        misses.fetch_add(1, std::memory_order_relaxed);
+        // opened under the shard lock, so concurrent first opens of one file map it once
+        file = MemoryDataStream::open(fname, mode, 0, flags);
+        if (!file)
+            return nullptr;
+
+        // the pool keeps its own reference, the file stays mapped while idle
+        file->addRef();
+        entry e;
+        e.stream = file;
+        e.bytes = file->mappedTotal();
+        e.keepForever = hasFlag(flags, allocator_flags::KEEP_FOREVER);
+        e.referenced = true;
+        s.theMap.emplace(id, e);
+        mappedBytes.fetch_add(e.bytes, std::memory_order_relaxed);
+        openFiles.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // other shards are locked one at a time, never while holding this one
+    if (overLimits())
+        evict(false);
+    return file;
+}
+
+bool MemoryFilePool::closeFile(const std::string& fname, FileMode mode)
+{
+    bool closed = false;
+    bool found = false;
+    try
+    {
+        MemoryFileId id(fname, mode);
+        shard& s = shardFor(id);
+        std::lock_guard<std::mutex> lock(s.mutex);
+
+        auto it = s.theMap.find(id);
+        if (it != s.theMap.end())
+        {
+            found = true;
+            closed = closeEntry(s, it);
+        }
+    }
+    catch (const std::invalid_argument&)
+    {
+        // unlinked or renamed since it was opened, looked up by name below
+    }
 
-    auto it = theMap.find(id);
-    if (it != theMap.end())
+    // the path may also name another file by now
+    for (size_t i = 0; !found && i < SHARD_COUNT; ++i)
     {
-        it->second->close();
-        if (!it->second->hasRef()) {
-            theMap.erase(it);
+        shard& s = shards[i];
+        std::lock_guard<std::mutex> lock(s.mutex);
+        for (auto it = s.theMap.begin(); it != s.theMap.end(); ++it)
+        {
+            const MemoryDataStream& stream = *it->second.stream;
+            if (stream.accessMode == mode && stream.filename == fname && stream.useCount() > 1)
+            {
+                found = true;
+                closed = closeEntry(s, it);
+                break;
+            }
         }
     }
-    else
+
+    if (closed && overLimits())
+        evict(false);
+    return closed;
+}
+
+bool MemoryFilePool::closeEntry(shard& s, map::iterator it)
+{
+    entry& e = it->second;
+    // only the pool's own reference left
+    if (e.stream->useCount() <= 1)
+        return false;
+
+    e.stream->close();
+    // an idle writable file would keep its reserved room on disk, visible to later opens
+    if (e.stream->isGrowable() && !e.keepForever && e.stream->closeIfLast())
+    {
+        mappedBytes.fetch_sub(e.bytes, std::memory_order_relaxed);
+        openFiles.fetch_sub(1, std::memory_order_relaxed);
+        if (s.hand == it)
+            s.hand = s.theMap.erase(it);
+        else
+            s.theMap.erase(it);
+        return true;
+    }
+
+    // writes may have grown the file, reads of a windowed one mapped more windows
+    size_t bytes = e.stream->mappedTotal();
+    mappedBytes.fetch_add(bytes - e.bytes, std::memory_order_relaxed);
+    e.bytes = bytes;
+    return true;
+}
+
+void MemoryFilePool::setLimits(size_t maxMappedBytesParam, size_t maxOpenFilesParam)
+{
+    maxMappedBytes.store(maxMappedBytesParam, std::memory_order_relaxed);
+    maxOpenFiles.store(maxOpenFilesParam, std::memory_order_relaxed);
+    if (overLimits())
+        evict(false);
+}
+
+void MemoryFilePool::trim()
+{
+    evict(true);
+}
+
+MemoryFilePool::stats MemoryFilePool::getStats() const
+{
+    stats res;
+    res.hits = hits.load(std::memory_order_relaxed);
+    res.misses = misses.load(std::memory_order_relaxed);
+    res.evictions = evictions.load(std::memory_order_relaxed);
+    res.mappedBytes = mappedBytes.load(std::memory_order_relaxed);
+    res.openFiles = openFiles.load(std::memory_order_relaxed);
+    return res;
+}
+
+bool MemoryFilePool::overLimits() const
+{
+    size_t bytesLimit = maxMappedBytes.load(std::memory_order_relaxed);
+    size_t filesLimit = maxOpenFiles.load(std::memory_order_relaxed);
+    return (bytesLimit && mappedBytes.load(std::memory_order_relaxed) > bytesLimit) ||
+           (filesLimit && openFiles.load(std::memory_order_relaxed) > filesLimit);
+}
+
+void MemoryFilePool::evict(bool all)
+{
+    // two rounds: the first one may only clear reference bits
+    for (size_t round = 0; round < 2 * SHARD_COUNT; ++round)
+    {
+        if (!all && !overLimits())
+            return;
+        shard& s = shards[evictHand.fetch_add(1, std::memory_order_relaxed) % SHARD_COUNT];
+        std::lock_guard<std::mutex> lock(s.mutex);
+        evictFrom(s, all);
+    }
+}
+
+void MemoryFilePool::evictFrom(shard& s, bool all)
+{
+    for (size_t step = 0, count = s.theMap.size(); step < count; ++step)
     {
-        throw std::invalid_argument("File "+fname+" not found in pool");
+        if (!all && !overLimits())
+            return;
+        if (s.hand == s.theMap.end())
+            s.hand = s.theMap.begin();
+
+        entry& e = s.hand->second;
+        // in use, cursors hold references too
+        if (e.keepForever || e.stream->useCount() > 1)
+        {
+            ++s.hand;
+            continue;
+        }
+        if (e.referenced && !all)
+        {
+            e.referenced = false;
+            ++s.hand;
+            continue;
+        }
+
+        // a cursor may have taken a reference since the check above
+        if (!e.stream->closeIfLast())
+        {
+            ++s.hand;
+            continue;
+        }
+        mappedBytes.fetch_sub(e.bytes, std::memory_order_relaxed);
+        openFiles.fetch_sub(1, std::memory_order_relaxed);
+        evictions.fetch_add(1, std::memory_order_relaxed);
+        s.hand = s.theMap.erase(s.hand);
     }
 }
 
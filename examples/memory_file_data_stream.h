@@ -2,6 +2,14 @@
 
 #include "data_stream.h"
 #include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+
+namespace sb { namespace common {
+class ThreadPool;
+}}
 
 namespace sb { namespace filesystem {
 
@@ -13,9 +21,20 @@ namespace sb { namespace filesystem {
             MAP_WHOLE_FILE = 1,
             ALLOW_REMAP = 2,
             BYPASS_FILE_POOL = 4,
-            KEEP_FOREVER = 8
+            KEEP_FOREVER = 8,
+            HUGE_PAGES = 16     ///< ask for transparent huge pages on mapped windows (posix only)
         };
 
+        inline allocator_flags operator|(allocator_flags a, allocator_flags b)
+        {
+            return static_cast<allocator_flags>(static_cast<int>(a) | static_cast<int>(b));
+        }
+
+        inline bool hasFlag(allocator_flags flags, allocator_flags flag)
+        {
+            return (static_cast<int>(flags) & static_cast<int>(flag)) != 0;
+        }
+
         struct memMapPlatformFields;
 
         enum class CacheHint
@@ -37,6 +56,7 @@ namespace sb { namespace filesystem {
 
             bool operator==(const fileIdPlatform& other) const;
             bool operator<(const fileIdPlatform& other) const;
+            size_t hash() const;
         };
 
         class MemoryFileId {
@@ -47,93 +67,407 @@ namespace sb { namespace filesystem {
             MemoryFileId(const std::string& fname, FileMode mode);
             bool operator==(const MemoryFileId& other) const;
             bool operator<(const MemoryFileId& other) const;
+            /// of (device, inode, mode)
+            size_t hash() const;
             fileIdPlatform* getFileId() const;
         private:
             fileIdPlatform* fileId;
         };
 
-        class MemoryDataStream : public DataStream
+        class MemoryDataStream;
+
+        /// read-only bytes inside a MemoryDataStream mapping; keeps its window mapped while alive,
+        /// must not outlive the stream and is invalid once the stream is closed
+        class MemoryView
+        {
+        public:
+            MemoryView() : stream(nullptr), ptr(nullptr), length(0) {}
+            MemoryView(const MemoryView& other);
+            MemoryView(MemoryView&& other);
+            MemoryView& operator=(MemoryView other);
+            ~MemoryView();
+
+            const uint8_t* data() const { return ptr; }
+            size_t size() const { return length; }
+            bool empty() const { return length == 0; }
+            const uint8_t* begin() const { return ptr; }
+            const uint8_t* end() const { return ptr + length; }
+            /// no range checking
+            uint8_t operator[](size_t offset) const { return ptr[offset]; }
+            uint8_t at(size_t offset) const;
+            /// part of this view, clamped to its end
+            MemoryView subview(size_t offset, size_t size) const;
+
+        private:
+            friend class MemoryDataStream;
+            MemoryView(const MemoryDataStream* stream, const uint8_t* ptr, size_t length);
+
+            const MemoryDataStream* stream;
+            const uint8_t* ptr;
+            size_t length;
+        };
+
+        /// completion of MemoryDataStream::flushAsync, shared by all requests merged into one group commit
+        class FlushHandle
+        {
+        public:
+            FlushHandle() {}
+
+            bool valid() const { return batch != nullptr; }
+            bool isDone() const;
+            /// block until the data reached stable storage, false if syncing failed or was abandoned
+            bool wait() const;
+
+        private:
+            friend class MemoryDataStream;
+            struct state;
+            explicit FlushHandle(const std::shared_ptr<state>& batchParam) : batch(batchParam) {}
+
+            std::shared_ptr<state> batch;
+        };
+
+        class MemoryStreamCursor;
+
+        class MemoryDataStream : public DataStream, public std::enable_shared_from_this<MemoryDataStream>
         {
             SQ_DECLARE_OBJECT(MemoryDataStream)
             friend class MemoryFilePool;
+            friend class MemoryView;
+            friend class MemoryStreamCursor;
         public:
             using sptr = std::shared_ptr<MemoryDataStream>;
 
+            /// window size used with allocator_flags::ALLOW_REMAP
+            static const size_t DEFAULT_WINDOW_SIZE = 64 * 1024 * 1024;
+            /// recently used windows kept mapped with allocator_flags::ALLOW_REMAP
+            static const size_t MAX_WINDOWS = 4;
+            /// bytes warmed by one read-ahead task
+            static const size_t DEFAULT_READ_AHEAD_CHUNK = 4 * 1024 * 1024;
+            /// smallest step a growable file is extended by
+            static const size_t MIN_GROWTH = 1024 * 1024;
+
 			MemoryDataStream();
-            MemoryDataStream(const std::string& filename, FileMode accessModeParam, size_t dataSize = 0 );
+            /// ALLOW_REMAP without MAP_WHOLE_FILE maps the file by page-aligned windows of `windowSize`
+            /// bytes which follow the accessed position, instead of mapping it all at once.
+            /// WRITE and APPEND streams grow on write past the end, `dataSize` is the initial capacity;
+            /// APPEND starts at the end of file. The unused tail is trimmed on close()
+            MemoryDataStream(const std::string& filename, FileMode accessModeParam, size_t dataSize = 0,
+                             allocator_flags flags = allocator_flags::MAP_WHOLE_FILE,
+                             size_t windowSize = DEFAULT_WINDOW_SIZE, CacheHint hint = CacheHint::Normal);
             ~MemoryDataStream();
             /// read `size` bytes to buffer, return realy readed bytes
             virtual size_t read(uint8_t* buffer, size_t size) override;
             /// seek to absolute position if from_current==false else to relative from current
             virtual size_t write(uint8_t* buffer, size_t size) override;
-            /// seek to absolute position if from_current==false else to relative from current
+            /// one bounds check and capacity reservation for all buffers
+            virtual size_t readv(const IoBuffer* buffers, size_t count) override;
+            virtual size_t writev(const IoBuffer* buffers, size_t count) override;
+            /// positional access; concurrent calls are safe on a whole-file mapping which doesn't grow,
+            /// windowed or growing streams need a MemoryStreamCursor per thread
+            virtual size_t pread(uint8_t* buffer, size_t size, size_t offset) override;
+            virtual size_t pwrite(uint8_t* buffer, size_t size, size_t offset) override;
+            /// seek to absolute position if from_current==false else to relative from current;
+            /// growable (WRITE, APPEND) streams may seek to getSize() to append
             virtual bool seek(std::streamoff offset, bool fromCurrent) override;
+            /// zero-copy read: view of up to `size` bytes at the current position, advances it
+            MemoryView readView(size_t size);
+            /// zero-copy access to [offset, offset + size) without moving the position,
+            /// throws std::out_of_range past the end of file
+            MemoryView peek(size_t offset, size_t size) const;
+            /// rest of the whole-file mapping or of the current window, not pinned
+            virtual const uint8_t* readDirect(size_t& size) override;
             /// eof indicator
             virtual bool eof() override;
             /// path information
             virtual const std::string& path() const override { return filename; }
 
-            static MemoryDataStream::sptr open(const std::string& fn, FileMode mode, size_t dataSize = 0);
+            static MemoryDataStream::sptr open(const std::string& fn, FileMode mode, size_t dataSize = 0,
+                                               allocator_flags flags = allocator_flags::MAP_WHOLE_FILE,
+                                               size_t windowSize = DEFAULT_WINDOW_SIZE,
+                                               CacheHint hint = CacheHint::Normal);
 
             /// get current position
             virtual size_t tell() override;
             virtual void close() override;
             virtual size_t getSize()  override;
+            /// new cursor over this mapping at position 0, the stream must be owned by a shared_ptr
             std::shared_ptr<DataStream> clone() override;
+            std::shared_ptr<MemoryStreamCursor> createCursor();
             virtual bool isValid() const override;
+            /// bytes of the current window, the whole file unless windowed
             size_t  mappedSize() const;
+            /// bytes of all windows mapped by the stream, cursors' own windows excluded
+            size_t  mappedTotal() const;
+            /// start of the whole file, nullptr when windowed
             const   uint8_t* getData() const;
+            /// synchronously write back everything modified since the last flush
             bool    save();
+            /// synchronously write back modified pages of a region
+            bool    flushRange(size_t offset, size_t size);
+            /// start write-back of modified pages of a region and make them durable on `pool`;
+            /// may be called from several threads writing through cursors. The pool must outlive the stream
+            FlushHandle flushAsync(sb::common::ThreadPool& pool, size_t offset = 0, size_t size = SIZE_MAX);
+            /// merge flushAsync requests issued while a previous one waits for a worker into a single sync
+            void    setGroupCommit(bool enabled) { groupCommit = enabled; }
+            bool    isWindowed() const;
+            bool    isGrowable() const;
+            /// bytes reserved in the file, at least getSize()
+            size_t  getCapacity() const { return capacity; }
+            /// reserve file space ahead of writes, growable streams only
+            bool    reserve(size_t size);
+
+            /// caching strategy of the whole file, applied to mapped and later windows
+            void    setCacheHint(CacheHint hintParam);
+            CacheHint getCacheHint() const { return hint; }
+            /// caching strategy of the currently mapped part of a region; false if unsupported
+            bool    adviseRange(size_t offset, size_t size, CacheHint hintParam);
+            /// start reading a region into the page cache ahead of access
+            bool    prefetch(size_t offset, size_t size);
+            /// release pages of a region already scanned past, clean data is re-read on next access
+            bool    dropRange(size_t offset, size_t size);
+            /// keep `distance` bytes ahead of the position in the page cache while reading forward:
+            /// tasks of `chunk` bytes run on `pool` at low priority, at most `maxInFlight` at once.
+            /// The pool must outlive the stream; distance 0 or a null pool turns read-ahead off
+            void    setReadAhead(sb::common::ThreadPool* pool, size_t distance,
+                                 size_t chunk = DEFAULT_READ_AHEAD_CHUNK, size_t maxInFlight = 4);
 
-            /// access position, no range checking (faster)
+            /// access position, no range checking (faster); may slide the window when windowed
             unsigned char operator[](size_t offset) const;
             unsigned char at(size_t offset) const;
 
 			size_t getFileSize();
-			void   memUnmap();
-			void*  memMap(size_t& bytesToMap, uint64_t offset);
-			int    getPageSize();
+			void   memUnmap(void* view, size_t bytes) const;
+			void*  memMap(size_t& bytesToMap, uint64_t offset) const;
+			bool   resizeFile(size_t newSize);
+			int    getPageSize() const;
 			void   fileOpen();
 			void   initFileOptions(FileMode accessModeParam);
 			void   initPlatformFields();
 			void   deletePlatformFields();
 			void   closeMappedFile();
         private:
+            struct readAheadState;
+            struct readAheadJob;
+            struct flushState;
+            struct flushJob;
+
+            struct mappedWindow
+            {
+                uint64_t offset;
+                size_t   bytes;
+                void*    view;
+                uint64_t lastUse;
+                // live MemoryViews, a pinned window is never unmapped by the LRU
+                int      pins;
+                // replaced by a remap, kept only until its views are gone
+                bool     retired;
+            };
 
             std::string filename;
-            // file size
+            // logical file size
             size_t  filesize;
+            // physical file size, larger than filesize while a growable stream has spare room
+            size_t  capacity;
             // caching strategy
             CacheHint   hint;
-            // mapped size
-            size_t  mappedBytes;
+            FileMode accessMode;
+            allocator_flags flags;
+            size_t windowSize;
+            // current window, the whole file unless windowed
+            mutable size_t  mappedBytes;
+            mutable uint64_t mappedOffset;
             size_t curPos;
-            int referenceCount;
+            std::atomic<int> referenceCount;
 
             memMapPlatformFields* mmPlatformFields;
-            void* mappedView;
+            mutable void* mappedView;
+            // mapped windows, least recently used is unmapped first; guarded by windowMutex,
+            // flushAsync walks them from other threads
+            mutable std::vector<mappedWindow> windows;
+            mutable std::mutex windowMutex;
+            mutable uint64_t windowClock;
+            std::shared_ptr<readAheadState> readAhead;
+            // page-aligned modified ranges, start -> end; guarded by dirtyMutex
+            std::map<uint64_t, uint64_t> dirty;
+            std::mutex dirtyMutex;
+            std::shared_ptr<flushState> flushes;
+            bool groupCommit;
 
             bool remap(uint64_t offset, size_t mappedBytes);
+            /// extend the file geometrically to hold `required` bytes
+            bool ensureCapacity(size_t required);
+            /// make a window holding at least `minBytes` (clamped to end of file) from `offset` current,
+            /// `available` gets contiguous bytes from it
+            uint8_t* windowFor(uint64_t offset, size_t minBytes, size_t& available) const;
+            void releaseWindows();
+            /// unmap everything and close the file, the last reference is gone
+            void shutdown();
+            /// close the stream if only the pool's own reference is left, atomically against
+            /// cursors taking new ones; false if the stream is in use
+            bool closeIfLast();
+            /// unmap windows without views, mark the rest retired
+            void retireWindows();
+            /// page-aligned parts of mapped windows inside [offset, offset + size), windowMutex is held
+            std::vector<std::pair<void*, size_t>> mappedPages(uint64_t offset, size_t size) const;
+            mappedWindow* findWindow(const void* ptr) const;
+            void pinWindow(const void* ptr) const;
+            void unpinWindow(const void* ptr) const;
+            /// queue read-ahead tasks for the part ahead of curPos not requested yet
+            void scheduleReadAhead();
+            void stopReadAhead();
+            /// bring a file region into the page cache, blocking; called on pool threads
+            static void warmFileRange(const memMapPlatformFields* fields, uint64_t offset, size_t size);
+            /// fields with a duplicated file handle for pool jobs, which may outlive close(); nullptr on failure
+            static memMapPlatformFields* shareFields(const memMapPlatformFields* fields);
+            static void releaseSharedFields(memMapPlatformFields* fields);
+            void markDirty(uint64_t offset, size_t size);
+            /// remove modified ranges inside [offset, offset + size) from the dirty set and return them
+            std::vector<std::pair<uint64_t, size_t>> takeDirty(uint64_t offset, size_t size);
+            /// write back mapped pages of a region, `wait` - until on disk, else only start it
+            bool syncRange(uint64_t offset, size_t size, bool wait);
+            /// make all written data of the file durable, blocking; called on pool threads too
+            static bool syncFile(const memMapPlatformFields* fields);
+            /// copy between the mapping and a buffer, [offset, offset + size) must be within capacity
+            size_t copyFrom(uint64_t offset, uint8_t* buffer, size_t size) const;
+            size_t copyTo(uint64_t offset, const uint8_t* buffer, size_t size);
+            /// bytes of [offset, offset + size) a write may touch, the file is extended when growable
+            size_t writableBytes(uint64_t offset, size_t size);
             void addRef();
             bool hasRef();
+            /// references held, including the one of MemoryFilePool
+            int useCount() const;
+        };
+
+        /// Independent position over a shared MemoryDataStream, created without syscalls.
+        /// Cursors of one stream may be used from different threads: over a whole-file read mapping
+        /// they share its memory, otherwise each maps its own window on first access.
+        /// The size is taken when the cursor is created. Holds a reference of the stream until closed
+        class MemoryStreamCursor : public DataStream
+        {
+            SQ_DECLARE_OBJECT(MemoryStreamCursor)
+        public:
+            using sptr = std::shared_ptr<MemoryStreamCursor>;
+
+            explicit MemoryStreamCursor(const MemoryDataStream::sptr& stream);
+            ~MemoryStreamCursor();
+
+            /// read `size` bytes to buffer, return realy readed bytes
+            virtual size_t read(uint8_t* buffer, size_t size) override;
+            /// write `size` bytes from buffer, never beyond the size of the file
+            virtual size_t write(uint8_t* buffer, size_t size) override;
+            /// seek to absolute position if from_current==false else to relative from current
+            virtual bool seek(std::streamoff offset, bool fromCurrent) override;
+            virtual bool eof() override { return curPos >= size; }
+            virtual bool isValid() const override { return stream && (base || stream->isValid()); }
+            virtual const std::string& path() const override { return stream->path(); }
+            virtual void close() override;
+            virtual size_t tell() override { return curPos; }
+            virtual size_t getSize() override { return size; }
+            /// another cursor over the same stream at position 0
+            std::shared_ptr<DataStream> clone() override;
+            /// rest of the shared mapping or of the cursor window
+            virtual const uint8_t* readDirect(size_t& size) override;
+
+            const MemoryDataStream::sptr& getStream() const { return stream; }
+
+        private:
+            /// `available` gets contiguous bytes at `offset`
+            uint8_t* windowFor(uint64_t offset, size_t& available);
+            void releaseWindow();
+
+            MemoryDataStream::sptr stream;
+            // whole-file mapping of the stream, nullptr - a private window is used
+            uint8_t* base;
+            size_t size;
+            size_t curPos;
+            void* windowView;
+            uint64_t windowOffset;
+            size_t windowBytes;
         };
 
+        /// Streams shared by file identity, safe to use from any thread.
+        /// Files are spread over SHARD_COUNT independently locked maps.
+        /// A file closed by all its users stays mapped for reuse until the pool runs over its limits,
+        /// then such idle files are closed in CLOCK order. Files opened with KEEP_FOREVER are never
+        /// evicted, BYPASS_FILE_POOL opens a private stream the caller closes itself
         class MemoryFilePool {
         public:
-            using map = std::map<MemoryFileId, MemoryDataStream::sptr> ;
             using sptr = std::shared_ptr<MemoryFilePool>;
 
+            static const size_t SHARD_COUNT = 16;
+            static const size_t DEFAULT_MAX_MAPPED_BYTES = size_t(1024) * 1024 * 1024;
+            static const size_t DEFAULT_MAX_OPEN_FILES = 512;
+
+            struct stats
+            {
+                uint64_t hits;
+                uint64_t misses;
+                uint64_t evictions;
+                size_t   mappedBytes;
+                size_t   openFiles;
+            };
+
             static sptr instance();
 
-            MemoryDataStream::sptr openFile(const std::string& fname, FileMode access_mode);
-            void closeFile(const std::string& fname, FileMode access_mode);
+            MemoryDataStream::sptr openFile(const std::string& fname, FileMode access_mode,
+                                            allocator_flags flags = allocator_flags::MAP_WHOLE_FILE);
+            /// false if the file isn't open through the pool, e.g. closed twice.
+            /// A writable file closed by its last user is closed by the pool too, which trims
+            /// the room reserved for writes; KEEP_FOREVER ones stay open untrimmed
+            bool closeFile(const std::string& fname, FileMode access_mode);
+
+            /// bounds for all pooled files, 0 - unlimited. Files in use are never closed,
+            /// so the totals may stay above the limits while they are open
+            void setLimits(size_t maxMappedBytes, size_t maxOpenFiles);
+            /// close every idle file except KEEP_FOREVER ones
+            void trim();
+            stats getStats() const;
 
         private:
-            MemoryFilePool(){};
+            MemoryFilePool();
+
+            struct entry
+            {
+                MemoryDataStream::sptr stream;
+                // all windows of the stream, refreshed whenever a user closes it
+                size_t bytes;
+                bool keepForever;
+                // CLOCK reference bit, set on every use
+                bool referenced;
+            };
+
+            using map = std::map<MemoryFileId, entry>;
+
+            struct shard
+            {
+                std::mutex mutex;
+                map theMap;
+                // position of the CLOCK hand in theMap
+                map::iterator hand;
+                // keep neighbouring shards off each other's cache line
+                char padding[64];
+            };
+
+            shard& shardFor(const MemoryFileId& id);
+            bool overLimits() const;
+            /// close idle files until back within the limits; `all` - ignore the limits and reference bits
+            void evict(bool all);
+            /// sweep one shard, its lock is held
+            void evictFrom(shard& s, bool all);
+            /// drop a user reference of a pooled file, its shard lock is held; false if the file is idle
+            bool closeEntry(shard& s, map::iterator it);
 
         private:
-            map theMap;
-            static sptr _instance;
+            shard shards[SHARD_COUNT];
+            std::atomic<size_t> maxMappedBytes;
+            std::atomic<size_t> maxOpenFiles;
+            std::atomic<size_t> mappedBytes;
+            std::atomic<size_t> openFiles;
+            std::atomic<uint64_t> hits;
+            std::atomic<uint64_t> misses;
+            std::atomic<uint64_t> evictions;
+            // next shard to sweep
+            std::atomic<size_t> evictHand;
         };
 
     }}
@@ -25,6 +25,34 @@ namespace sb { namespace filesystem {
             ino_t inode;
         };
 
+        static int toMadvise(CacheHint hint)
+        {
+            switch (hint)
+            {
+                case CacheHint::SequentialScan:
+                    return MADV_SEQUENTIAL;
+                case CacheHint::RandomAccess:
+                    return MADV_RANDOM;
+                case CacheHint::Normal:
+                default:
+                    return MADV_NORMAL;
+            }
+        }
+
+        static int toFadvise(CacheHint hint)
+        {
+            switch (hint)
+            {
+                case CacheHint::SequentialScan:
+                    return POSIX_FADV_SEQUENTIAL;
+                case CacheHint::RandomAccess:
+                    return POSIX_FADV_RANDOM;
+                case CacheHint::Normal:
+                default:
+                    return POSIX_FADV_NORMAL;
+            }
+        }
+
         fileIdPlatform::fileIdPlatform()
         {
             fields = std::unique_ptr<fileIdPlatformFields>(new fileIdPlatformFields());
@@ -64,6 +92,14 @@ namespace sb { namespace filesystem {
                    fields->accessMode == other.fields->accessMode;
         }
 
+        size_t fileIdPlatform::hash() const
+        {
+            size_t res = std::hash<uint64_t>()(static_cast<uint64_t>(fields->inode));
+            res ^= std::hash<uint64_t>()(static_cast<uint64_t>(fields->device)) + 0x9e3779b9 + (res << 6) + (res >> 2);
+            res ^= static_cast<size_t>(fields->accessMode) + 0x9e3779b9 + (res << 6) + (res >> 2);
+            return res;
+        }
+
         bool fileIdPlatform::operator<(const fileIdPlatform& other) const
         {
             return fields->inode < other.fields->inode ||
@@ -88,10 +124,40 @@ namespace sb { namespace filesystem {
 			//mmPlatformFields = std::make_shared<memMapPlatformFields>();
 		}
 
-        bool MemoryDataStream::save()
+        bool MemoryDataStream::syncRange(uint64_t offset, size_t size, bool wait)
         {
-            int filesize = getFileSize();
-            return (msync(mappedView, filesize, MS_SYNC) != -1);
+#if defined(__linux__) && defined(SYNC_FILE_RANGE_WRITE)
+            // MS_ASYNC is a no-op on linux, start write-back through the descriptor instead
+            if (!wait)
+                return ::sync_file_range(mmPlatformFields->file, offset, size, SYNC_FILE_RANGE_WRITE) == 0;
+#endif
+            std::lock_guard<std::mutex> lock(windowMutex);
+            bool res = true;
+            for (auto& pages : mappedPages(offset, size))
+            {
+                if (::msync(pages.first, pages.second, wait ? MS_SYNC : MS_ASYNC) == -1)
+                    res = false;
+            }
+            return res;
+        }
+
+        bool MemoryDataStream::syncFile(const memMapPlatformFields* fields)
+        {
+#if defined(__APPLE__)
+            return ::fsync(fields->file) == 0;
+#else
+            return ::fdatasync(fields->file) == 0;
+#endif
+        }
+
+        bool MemoryDataStream::resizeFile(size_t newSize)
+        {
+#ifdef __linux__
+            // allocate blocks up front, a full disk then fails here and not as SIGBUS on a mapped write
+            if (newSize > getFileSize() && ::fallocate(mmPlatformFields->file, 0, 0, newSize) == 0)
+                return true;
+#endif
+            return ::ftruncate(mmPlatformFields->file, newSize) == 0;
         }
 
         size_t MemoryDataStream::getFileSize()
@@ -120,18 +186,18 @@ namespace sb { namespace filesystem {
 			mmPlatformFields->file = 0;
         }
 
-        void MemoryDataStream::memUnmap()
+        void MemoryDataStream::memUnmap(void* view, size_t bytes) const
         {
-            ::munmap(mappedView, mappedBytes);
+            ::munmap(view, bytes);
         }
 
-        void* MemoryDataStream::memMap(size_t& bytesToMap, uint64_t offset)
+        void* MemoryDataStream::memMap(size_t& bytesToMap, uint64_t offset) const
         {
             if (!mmPlatformFields->file)
                 return nullptr;
 
 
-            if (bytesToMap > filesize && mmPlatformFields->fileOpenMode != O_RDONLY)
+            if (offset + bytesToMap > capacity && mmPlatformFields->fileOpenMode != O_RDONLY)
             {
                 if (lseek(mmPlatformFields->file, bytesToMap - 1, SEEK_SET) < 0)
                 {
@@ -155,33 +221,93 @@ namespace sb { namespace filesystem {
                 return nullptr;
             }
 
-            auto linuxHint = 0;
-            switch (hint)
+            ::madvise(mappedView, bytesToMap, toMadvise(hint));
+#ifdef MADV_HUGEPAGE
+            // needs THP for file mappings in the kernel, ignored otherwise
+            if (hasFlag(flags, allocator_flags::HUGE_PAGES))
+                ::madvise(mappedView, bytesToMap, MADV_HUGEPAGE);
+#endif
+
+            return mappedView;
+
+        }
+
+        void MemoryDataStream::setCacheHint(CacheHint hintParam)
+        {
+            hint = hintParam;
+            if (mmPlatformFields->file > 0)
+                ::posix_fadvise(mmPlatformFields->file, 0, 0, toFadvise(hint));
+            std::lock_guard<std::mutex> lock(windowMutex);
+            for (auto& window : windows)
+                ::madvise(window.view, window.bytes, toMadvise(hint));
+        }
+
+        bool MemoryDataStream::adviseRange(size_t offset, size_t size, CacheHint hintParam)
+        {
+            std::lock_guard<std::mutex> lock(windowMutex);
+            bool res = true;
+            for (auto& pages : mappedPages(offset, size))
             {
-                case CacheHint::Normal:
-                    linuxHint = MADV_NORMAL;
-                    break;
-                case CacheHint::SequentialScan:
-                    linuxHint = MADV_SEQUENTIAL;
-                    break;
-                case CacheHint::RandomAccess:
-                    linuxHint = MADV_RANDOM;
-                    break;
-                default:
-                    break;
+                if (::madvise(pages.first, pages.second, toMadvise(hintParam)) != 0)
+                    res = false;
             }
-            // assume that file will be accessed soon
-            //linuxHint |= MADV_WILLNEED;
-            // assume that file will be large
-            //linuxHint |= MADV_HUGEPAGE;
+            return res;
+        }
 
-            ::madvise(mappedView, bytesToMap, linuxHint);
+        bool MemoryDataStream::prefetch(size_t offset, size_t size)
+        {
+            if (mmPlatformFields->file <= 0)
+                return false;
+            // page cache readahead works for mapped and not yet mapped parts alike
+            return ::posix_fadvise(mmPlatformFields->file, offset, size, POSIX_FADV_WILLNEED) == 0;
+        }
 
-            return mappedView;
+        void MemoryDataStream::warmFileRange(const memMapPlatformFields* fields, uint64_t offset, size_t size)
+        {
+#ifdef __linux__
+            ::readahead(fields->file, offset, size);
+#else
+            ::posix_fadvise(fields->file, offset, size, POSIX_FADV_WILLNEED);
+#endif
+        }
+
+        memMapPlatformFields* MemoryDataStream::shareFields(const memMapPlatformFields* fields)
+        {
+            int file = fields->file > 0 ? ::fcntl(fields->file, F_DUPFD_CLOEXEC, 0) : -1;
+            if (file < 0)
+                return nullptr;
+            memMapPlatformFields* res = new memMapPlatformFields(*fields);
+            res->file = file;
+            return res;
+        }
 
+        void MemoryDataStream::releaseSharedFields(memMapPlatformFields* fields)
+        {
+            if (!fields)
+                return;
+            ::close(fields->file);
+            delete fields;
         }
 
-        int MemoryDataStream::getPageSize()
+        bool MemoryDataStream::dropRange(size_t offset, size_t size)
+        {
+            bool res = true;
+            {
+                std::lock_guard<std::mutex> lock(windowMutex);
+                for (auto& pages : mappedPages(offset, size))
+                {
+                    if (::madvise(pages.first, pages.second, MADV_DONTNEED) != 0)
+                        res = false;
+                }
+            }
+            // dirty pages are kept by the kernel until written back
+            if (mmPlatformFields->file <= 0 ||
+                ::posix_fadvise(mmPlatformFields->file, offset, size, POSIX_FADV_DONTNEED) != 0)
+                res = false;
+            return res;
+        }
+
+        int MemoryDataStream::getPageSize() const
         {
             return sysconf(_SC_PAGESIZE);
         }
@@ -197,6 +323,9 @@ namespace sb { namespace filesystem {
                 return;
             }
 
+            if (hint != CacheHint::Normal)
+                ::posix_fadvise(mmPlatformFields->file, 0, 0, toFadvise(hint));
+
         }
 
         void MemoryDataStream::initFileOptions(FileMode accessModeParam)
@@ -214,11 +343,11 @@ namespace sb { namespace filesystem {
 					mmPlatformFields->fileOpenMode = O_RDWR | O_CREAT;
                     break;
                 case FileMode::WRITE:
-                    /*APPEND MODE TBD*/
                 case FileMode::APPEND:
-					mmPlatformFields->prot = PROT_WRITE;
+					// a shared mapping needs a descriptor open for reading too
+					mmPlatformFields->prot = PROT_READ | PROT_WRITE;
 					mmPlatformFields->mmapMode |= MAP_SHARED;
-					mmPlatformFields->fileOpenMode = O_WRONLY | O_CREAT;
+					mmPlatformFields->fileOpenMode = O_RDWR | O_CREAT;
                     break;
                 default:
                     break;
@@ -4,6 +4,7 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <mutex>
 
 #include "filesystem/memory_file_data_stream.h"
 
@@ -18,6 +19,8 @@ struct memMapPlatformFields
     int prot = 0;
     int mmapMode = 0;
     int protectionMode = 0;
+    // memMap replaces the mapping object, cursors map their windows concurrently
+    std::mutex mapMutex;
 };
 
 struct fileIdPlatformFields
@@ -74,6 +77,14 @@ bool fileIdPlatform::operator==(const fileIdPlatform& other) const
            fields->accessMode == other.fields->accessMode;
 }
 
+size_t fileIdPlatform::hash() const
+{
+    size_t res = std::hash<uint64_t>()(static_cast<uint64_t>(fields->ino));
+    res ^= std::hash<uint64_t>()(static_cast<uint64_t>(fields->dev)) + 0x9e3779b9 + (res << 6) + (res >> 2);
+    res ^= static_cast<size_t>(fields->accessMode) + 0x9e3779b9 + (res << 6) + (res >> 2);
+    return res;
+}
+
 bool fileIdPlatform::operator<(const fileIdPlatform& other) const
 {
     return (fields->ino < other.fields->ino) ||
@@ -107,10 +118,41 @@ void MemoryDataStream::deletePlatformFields()
 	//mmPlatformFields = std::make_shared<memMapPlatformFields>();
 }
 
-bool MemoryDataStream::save()
+bool MemoryDataStream::syncRange(uint64_t offset, size_t size, bool wait)
 {
-    int filesize = getFileSize();
-    return ::FlushViewOfFile(mappedView, filesize);
+    bool res = true;
+    {
+        std::lock_guard<std::mutex> lock(windowMutex);
+        for (auto& pages : mappedPages(offset, size))
+        {
+            if (!::FlushViewOfFile(pages.first, pages.second))
+                res = false;
+        }
+    }
+    // FlushViewOfFile doesn't wait for the disk
+    if (wait && !syncFile(mmPlatformFields))
+        res = false;
+    return res;
+}
+
+bool MemoryDataStream::syncFile(const memMapPlatformFields* fields)
+{
+    return ::FlushFileBuffers(fields->file) != 0;
+}
+
+bool MemoryDataStream::resizeFile(size_t newSize)
+{
+    // the end of file can't move below an open mapping object
+    if (mmPlatformFields->mappedFile)
+    {
+        ::CloseHandle(mmPlatformFields->mappedFile);
+        mmPlatformFields->mappedFile = nullptr;
+    }
+
+    LARGE_INTEGER size;
+    size.QuadPart = static_cast<LONGLONG>(newSize);
+    return ::SetFilePointerEx(mmPlatformFields->file, size, nullptr, FILE_BEGIN) &&
+           ::SetEndOfFile(mmPlatformFields->file);
 }
 
 size_t MemoryDataStream::getFileSize()
@@ -141,23 +183,27 @@ void MemoryDataStream::closeMappedFile()
     }
 }
 
-void MemoryDataStream::memUnmap()
+void MemoryDataStream::memUnmap(void* view, size_t /*bytes*/) const
 {
-    ::UnmapViewOfFile(mappedView);
+    ::UnmapViewOfFile(view);
 }
 
-void* MemoryDataStream::memMap(size_t& bytesToMap, uint64_t offset)
+void* MemoryDataStream::memMap(size_t& bytesToMap, uint64_t offset) const
 {
     if(!mmPlatformFields->file)
         return nullptr;
 
+    std::lock_guard<std::mutex> lock(mmPlatformFields->mapMutex);
     if (mmPlatformFields->mappedFile)
     {
         ::CloseHandle(mmPlatformFields->mappedFile);
 		mmPlatformFields->mappedFile = nullptr;
     }
 
-	mmPlatformFields->mappedFile = ::CreateFileMapping(mmPlatformFields->file, nullptr, mmPlatformFields->protectionMode, offset, bytesToMap, nullptr);
+    // mapping object must cover the end of the view
+    uint64_t mappingSize = offset + bytesToMap;
+	mmPlatformFields->mappedFile = ::CreateFileMapping(mmPlatformFields->file, nullptr, mmPlatformFields->protectionMode,
+	                                                   DWORD(mappingSize >> 32), DWORD(mappingSize & 0xFFFFFFFF), nullptr);
 
     if (!mmPlatformFields->mappedFile)
     {
@@ -186,7 +232,91 @@ void* MemoryDataStream::memMap(size_t& bytesToMap, uint64_t offset)
 }
 
 
-int MemoryDataStream::getPageSize()
+void MemoryDataStream::setCacheHint(CacheHint hintParam)
+{
+    // FILE_FLAG_* hints are fixed when the file is opened
+    hint = hintParam;
+}
+
+bool MemoryDataStream::adviseRange(size_t /*offset*/, size_t /*size*/, CacheHint /*hintParam*/)
+{
+    return false;
+}
+
+bool MemoryDataStream::prefetch(size_t offset, size_t size)
+{
+#if _WIN32_WINNT >= 0x0602
+    std::vector<WIN32_MEMORY_RANGE_ENTRY> ranges;
+    std::lock_guard<std::mutex> lock(windowMutex);
+    for (auto& pages : mappedPages(offset, size))
+    {
+        WIN32_MEMORY_RANGE_ENTRY entry;
+        entry.VirtualAddress = pages.first;
+        entry.NumberOfBytes = pages.second;
+        ranges.push_back(entry);
+    }
+    if (ranges.empty())
+        return false;
+    return ::PrefetchVirtualMemory(::GetCurrentProcess(), ranges.size(), ranges.data(), 0) != 0;
+#else
+    (void)offset;
+    (void)size;
+    return false;
+#endif
+}
+
+void MemoryDataStream::warmFileRange(const memMapPlatformFields* fields, uint64_t offset, size_t size)
+{
+    // positional reads through the system cache, the data itself is discarded
+    std::vector<char> buffer(std::min<size_t>(size, 1024 * 1024));
+    while (size)
+    {
+        OVERLAPPED position = {};
+        position.Offset = DWORD(offset & 0xFFFFFFFF);
+        position.OffsetHigh = DWORD(offset >> 32);
+        DWORD bytesRead = 0;
+        DWORD toRead = DWORD(std::min(size, buffer.size()));
+        if (!::ReadFile(fields->file, buffer.data(), toRead, &bytesRead, &position) || !bytesRead)
+            break;
+        offset += bytesRead;
+        size -= bytesRead;
+    }
+}
+
+memMapPlatformFields* MemoryDataStream::shareFields(const memMapPlatformFields* fields)
+{
+    HANDLE process = ::GetCurrentProcess();
+    HANDLE file = nullptr;
+    if (!fields->file || fields->file == INVALID_HANDLE_VALUE ||
+        !::DuplicateHandle(process, fields->file, process, &file, 0, FALSE, DUPLICATE_SAME_ACCESS))
+        return nullptr;
+    // the mapping object stays with the stream
+    memMapPlatformFields* res = new memMapPlatformFields();
+    res->file = file;
+    res->mappedFile = nullptr;
+    res->fileOpenMode = fields->fileOpenMode;
+    res->sharedMode = fields->sharedMode;
+    return res;
+}
+
+void MemoryDataStream::releaseSharedFields(memMapPlatformFields* fields)
+{
+    if (!fields)
+        return;
+    ::CloseHandle(fields->file);
+    delete fields;
+}
+
+bool MemoryDataStream::dropRange(size_t offset, size_t size)
+{
+    // unlocking pages which are not locked trims them from the working set
+    std::lock_guard<std::mutex> lock(windowMutex);
+    for (auto& pages : mappedPages(offset, size))
+        ::VirtualUnlock(pages.first, pages.second);
+    return true;
+}
+
+int MemoryDataStream::getPageSize() const
 {
     SYSTEM_INFO sysInfo;
     GetSystemInfo(&sysInfo);
@@ -253,7 +383,7 @@ void MemoryDataStream::initFileOptions(FileMode accessModeParam)
         case FileMode::APPEND:
 			mmPlatformFields->fileOpenMode = GENERIC_READ | GENERIC_WRITE;
 			mmPlatformFields->sharedMode = 0;
-			mmPlatformFields->prot = OPEN_EXISTING;
+			mmPlatformFields->prot = OPEN_ALWAYS;
 			mmPlatformFields->mmapMode = FILE_MAP_WRITE;
 			mmPlatformFields->protectionMode = PAGE_READWRITE;
             break;
@@ -0,0 +1,104 @@
+#include "filesystem/parallel_line_reader.h"
+#include "common/ThreadPool.h"
+#include "common/ParallelAlgorithms.h"
+#include <deque>
+
+namespace sb { namespace filesystem {
+
+ParallelLineReader::ParallelLineReader(const MemoryDataStream::sptr& streamParam, common::ThreadPool& poolParam,
+                                       size_t chunkCountParam) :
+    stream(streamParam),
+    pool(poolParam),
+    size(streamParam->getSize()),
+    chunkCount(chunkCountParam)
+{
+    if (!chunkCount)
+    {
+        chunkCount = std::max<size_t>(pool.max_threads(), 1) * CHUNKS_PER_THREAD;
+        chunkCount = std::min(chunkCount, size / MIN_CHUNK_SIZE);
+        chunkCount = std::max(chunkCount, (size + MAX_CHUNK_SIZE - 1) / MAX_CHUNK_SIZE);
+    }
+    chunkCount = std::max<size_t>(std::min(chunkCount, size), 1);
+}
+
+size_t ParallelLineReader::chunkOffset(size_t chunk) const
+{
+    // split as size * chunk / chunkCount without overflowing the product
+    return size / chunkCount * chunk + size % chunkCount * chunk / chunkCount;
+}
+
+template<typename F>
+void ParallelLineReader::readChunk(size_t chunk, F&& handler)
+{
+    size_t begin = chunkOffset(chunk);
+    size_t end = chunkOffset(chunk + 1);
+    if (begin == end)
+        return;
+
+    StreamLineReader reader(stream->createCursor());
+    if (begin)
+    {
+        // skip the line in progress, it belongs to the previous chunk.
+        // If byte begin - 1 is a newline this reads an empty line and stops right at begin
+        reader.getStream()->seek(begin - 1, false);
+        reader.nextLine();
+    }
+
+    // a line starts before `end` exactly when it starts before the next chunk's first line
+    while (!reader.eof() && reader.tell() < end)
+        handler(reader.nextLine());
+}
+
+void ParallelLineReader::forEachLine(const chunkLineHandler& handler)
+{
+    common::parallel_for(pool, size_t(0), chunkCount, [this, &handler](size_t chunk) {
+        readChunk(chunk, [chunk, &handler](const LineView& line) { handler(chunk, line); });
+    }, 1);
+}
+
+ParallelLineReader::bufferedChunk ParallelLineReader::bufferChunk(size_t chunk)
+{
+    bufferedChunk res;
+    readChunk(chunk, [&res](const LineView& line) {
+        res.lines.emplace_back(res.text.size(), line.size());
+        res.text.insert(res.text.end(), line.begin(), line.end());
+    });
+    return res;
+}
+
+void ParallelLineReader::forEachLineOrdered(const lineHandler& handler, size_t maxPendingChunks)
+{
+    if (!maxPendingChunks)
+        maxPendingChunks = std::max<size_t>(pool.max_threads(), 1) * 2;
+
+    std::deque<common::ThreadPool::future<bufferedChunk>> pending;
+    size_t submitted = 0;
+    try
+    {
+        for (size_t chunk = 0; chunk < chunkCount; ++chunk)
+        {
+            for (; submitted < chunkCount && submitted < chunk + maxPendingChunks; ++submitted)
+            {
+                size_t next = submitted;
+                pending.push_back(pool.submit([this, next]() { return bufferChunk(next); }));
+            }
+
+            common::ThreadPool::future<bufferedChunk> front = std::move(pending.front());
+            pending.pop_front();
+            // the pool refused the task, read it here
+            bufferedChunk lines = front.valid() ? front.get() : bufferChunk(chunk);
+            for (auto& line : lines.lines)
+                handler(LineView(lines.text.data() + line.first, line.second));
+        }
+    }
+    catch (...)
+    {
+        // queued tasks still reference this reader
+        for (auto& task : pending)
+            if (task.valid())
+                task.wait();
+        throw;
+    }
+}
+
+}}
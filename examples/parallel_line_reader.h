@@ -0,0 +1,63 @@
+#pragma once
+
+#include "filesystem/memory_file_data_stream.h"
+#include <functional>
+
+namespace sb { namespace common {
+class ThreadPool;
+}}
+
+namespace sb { namespace filesystem {
+
+/// Splits a mapped file into byte ranges snapped to line starts and reads them concurrently
+/// on a ThreadPool. Every chunk reads through its own MemoryStreamCursor, so lines of a
+/// whole-file mapping are not copied. A line belongs to the chunk its first byte is in
+class ParallelLineReader : public sq::common::noncopyable
+{
+public:
+    /// `chunk` - index of the chunk in file order, `line` is valid during the call only
+    using chunkLineHandler = std::function<void(size_t chunk, const LineView& line)>;
+    using lineHandler = std::function<void(const LineView& line)>;
+
+    /// smallest range given to one task when the chunk count is chosen automatically
+    static const size_t MIN_CHUNK_SIZE = 1024 * 1024;
+    /// largest range of an automatically chosen chunk, bounds the memory of the ordered merge
+    static const size_t MAX_CHUNK_SIZE = 16 * 1024 * 1024;
+    /// chunks per pool thread when the chunk count is chosen automatically
+    static const size_t CHUNKS_PER_THREAD = 4;
+
+    /// `chunkCount` 0 - chosen from the file size and pool threads.
+    /// The stream must be owned by a shared_ptr and not be resized while reading
+    ParallelLineReader(const MemoryDataStream::sptr& stream, common::ThreadPool& pool, size_t chunkCount = 0);
+
+    /// call `handler` for every line on pool threads: lines of one chunk in order, chunks concurrently.
+    /// Returns when all chunks are done, rethrows the first exception of the handler
+    void forEachLine(const chunkLineHandler& handler);
+    /// call `handler` on the calling thread for every line in file order. Chunks are read ahead
+    /// concurrently, at most `maxPendingChunks` of them are buffered
+    void forEachLineOrdered(const lineHandler& handler, size_t maxPendingChunks = 0);
+
+    size_t getChunkCount() const { return chunkCount; }
+    /// nominal start of a chunk, its first line starts at or after it
+    size_t chunkOffset(size_t chunk) const;
+
+private:
+    /// lines of one chunk copied for the ordered merge
+    struct bufferedChunk
+    {
+        std::vector<char> text;
+        std::vector<std::pair<size_t, size_t>> lines;
+    };
+
+    /// call `handler` for the lines starting in chunk `chunk`
+    template<typename F>
+    void readChunk(size_t chunk, F&& handler);
+    bufferedChunk bufferChunk(size_t chunk);
+
+    MemoryDataStream::sptr stream;
+    common::ThreadPool& pool;
+    size_t size;
+    size_t chunkCount;
+};
+
+}}